@@ -0,0 +1,471 @@
+// Copyright (c) 2015, Robot Control and Pattern Recognition Group,
+// Institute of Control and Computation Engineering
+// Warsaw University of Technology
+//
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Warsaw University of Technology nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYright HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Author: Dawid Seredynski
+//
+
+// Benchmarks of the reachability and distance maps. Usage:
+//   reachability_map_bench layout [voxels]
+//   reachability_map_bench interpolation [voxels]
+//   reachability_map_bench batch [voxels]
+//   reachability_map_bench kernels
+//   reachability_map_bench sampler [dof] [reference_samples]
+// The distance maps cover a 1.2 m cube with voxels^3 voxels (200 by default for layout,
+// 120 for interpolation and 80 for batch); the precomputed coefficients take 512 B per voxel.
+// The sampler benchmark generates the maps of a serial chain of dof joints (3 by default)
+// and prints their coverage of a reference map of reference_samples samples (8M by default).
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "planer_utils/reachability_map.h"
+
+static const double MAP_SIZE = 1.2;
+static const KDL::Vector MAP_LOWER(0, 0, 0);
+static const KDL::Vector MAP_UPPER(MAP_SIZE, MAP_SIZE, MAP_SIZE);
+static const KDL::Vector MAP_ORIGIN(0.6, 0.6, 0.6);
+
+// two spheres and the floor
+static bool sceneCollision(const KDL::Vector &x) {
+    return (x - KDL::Vector(0.3, 0.4, 0.5)).Norm() < 0.15 || (x - KDL::Vector(0.8, 0.7, 0.6)).Norm() < 0.2 || x.z() < 0.1;
+}
+
+static double randomUnit() {
+    return static_cast<double >(rand()) / static_cast<double >(RAND_MAX);
+}
+
+// count points spread over the map, and count points along a random walk, for the coherent queries
+static void generateQueries(int count, std::vector<KDL::Vector > &random_points, std::vector<KDL::Vector > &coherent_points) {
+    srand(1);
+    random_points.resize(count);
+    for (int i = 0; i < count; i++) {
+        random_points[i] = KDL::Vector(0.05 + 1.1 * randomUnit(), 0.05 + 1.1 * randomUnit(), 0.05 + 1.1 * randomUnit());
+    }
+    coherent_points.resize(count);
+    KDL::Vector pt(MAP_ORIGIN), dir(0.0003, 0.0002, 0.0001);
+    for (int i = 0; i < count; i++) {
+        if (i % 1000 == 0) {
+            dir = KDL::Vector(0.0003 * (randomUnit() - 0.5), 0.0003 * (randomUnit() - 0.5), 0.0003 * (randomUnit() - 0.5));
+        }
+        pt = pt + dir;
+        for (int k = 0; k < 3; k++) {
+            if (pt[k] < 0.05 || pt[k] > MAP_SIZE - 0.05) {
+                dir[k] = -dir[k];
+                pt[k] += 2.0 * dir[k];
+            }
+        }
+        coherent_points[i] = pt;
+    }
+}
+
+class Timer {
+public:
+    Timer() :
+        start_(boost::posix_time::microsec_clock::universal_time())
+    {
+    }
+
+    // [ns] per one of count operations
+    double getTime(int count) const {
+        return (boost::posix_time::microsec_clock::universal_time() - start_).total_microseconds() * 1000.0 / count;
+    }
+
+private:
+    boost::posix_time::ptime start_;
+};
+
+// the sums are printed, so the queries are not optimized out
+static void benchLayout(int voxels) {
+    const double voxel_size = MAP_SIZE / voxels;
+    const int queries_count = 2000000;
+    std::vector<KDL::Vector > random_points, coherent_points;
+    generateQueries(queries_count, random_points, coherent_points);
+
+    ReachabilityMap::DistanceMapParams edt_params;
+    edt_params.method_ = ReachabilityMap::DistanceMapParams::METHOD_EDT;
+
+    const ReachabilityMap::DistanceMapLayout layouts[3] = {ReachabilityMap::LAYOUT_ROW_MAJOR, ReachabilityMap::LAYOUT_BRICKS, ReachabilityMap::LAYOUT_BRICKS};
+    const int brick_sizes[3] = {1, 4, 8};
+    const char *layout_names[3] = {"row-major", "bricks 4 ", "bricks 8 "};
+    std::cout << "layout     queries   trilinear [ns]  tricubic [ns]  getAllGradients [ns]" << std::endl;
+    for (int layout_idx = 0; layout_idx < 3; layout_idx++) {
+        ReachabilityMap edt_map(voxel_size, 3);
+        edt_map.setDistanceMapLayout(layouts[layout_idx], brick_sizes[layout_idx]);
+        edt_map.createDistanceMap(MAP_ORIGIN, sceneCollision, MAP_LOWER, MAP_UPPER, edt_params);
+        ReachabilityMap bfs_map(voxel_size, 3);
+        bfs_map.setDistanceMapLayout(layouts[layout_idx], brick_sizes[layout_idx]);
+        bfs_map.createDistanceMap(MAP_ORIGIN, sceneCollision, MAP_LOWER, MAP_UPPER);
+
+        for (int coherent = 0; coherent < 2; coherent++) {
+            const std::vector<KDL::Vector > &points = (coherent ? coherent_points : random_points);
+            double sum = 0.0;
+            double distance;
+
+            Timer trilinear_timer;
+            for (int i = 0; i < queries_count; i++) {
+                if (edt_map.getDistance<ReachabilityMap::InterpolationTrilinear >(points[i], distance)) {
+                    sum += distance;
+                }
+            }
+            double trilinear_time = trilinear_timer.getTime(queries_count);
+
+            Timer tricubic_timer;
+            for (int i = 0; i < queries_count / 4; i++) {
+                if (edt_map.getDistance(points[i], distance)) {
+                    sum += distance;
+                }
+            }
+            double tricubic_time = tricubic_timer.getTime(queries_count / 4);
+
+            std::vector<ReachabilityMap::GradientInfo > gradients(27);
+            Timer gradients_timer;
+            for (int i = 0; i < queries_count / 8; i++) {
+                if (bfs_map.getAllGradients(points[i], gradients)) {
+                    sum += (gradients[0].valid_ ? gradients[0].value_ : 0.0);
+                }
+            }
+            double gradients_time = gradients_timer.getTime(queries_count / 8);
+
+            std::cout << layout_names[layout_idx] << "  " << (coherent ? "coherent" : "random  ") << "  " << trilinear_time << "  " << tricubic_time
+                << "  " << gradients_time << "  (" << sum << ")" << std::endl;
+        }
+    }
+}
+
+// the interpolation policies of getDistance<Interpolation>() on random points, and the tricubic
+// interpolation without the coefficient cache and with the precomputed coefficients
+static void benchInterpolation(int voxels) {
+    const double voxel_size = MAP_SIZE / voxels;
+    const int queries_count = 2000000;
+    std::vector<KDL::Vector > random_points, coherent_points;
+    generateQueries(queries_count, random_points, coherent_points);
+
+    ReachabilityMap::DistanceMapParams edt_params;
+    edt_params.method_ = ReachabilityMap::DistanceMapParams::METHOD_EDT;
+    ReachabilityMap edt_map(voxel_size, 3);
+    edt_map.createDistanceMap(MAP_ORIGIN, sceneCollision, MAP_LOWER, MAP_UPPER, edt_params);
+
+    double sum = 0.0;
+    double distance;
+
+    Timer nearest_timer;
+    for (int i = 0; i < queries_count; i++) {
+        if (edt_map.getDistance<ReachabilityMap::InterpolationNearest >(random_points[i], distance)) {
+            sum += distance;
+        }
+    }
+    double nearest_time = nearest_timer.getTime(queries_count);
+
+    Timer trilinear_timer;
+    for (int i = 0; i < queries_count; i++) {
+        if (edt_map.getDistance<ReachabilityMap::InterpolationTrilinear >(random_points[i], distance)) {
+            sum += distance;
+        }
+    }
+    double trilinear_time = trilinear_timer.getTime(queries_count);
+
+    Timer tricubic_timer;
+    for (int i = 0; i < queries_count / 4; i++) {
+        if (edt_map.getDistance<ReachabilityMap::InterpolationTricubic >(random_points[i], distance)) {
+            sum += distance;
+        }
+    }
+    double tricubic_time = tricubic_timer.getTime(queries_count / 4);
+
+    edt_map.setCoefficientCache(ReachabilityMap::COEFF_CACHE_PRECOMPUTED, 0);
+    Timer precomputed_timer;
+    for (int i = 0; i < queries_count; i++) {
+        if (edt_map.getDistance<ReachabilityMap::InterpolationTricubic >(random_points[i], distance)) {
+            sum += distance;
+        }
+    }
+    double precomputed_time = precomputed_timer.getTime(queries_count);
+
+    std::cout << "nearest [ns]  trilinear [ns]  tricubic [ns]  tricubic precomputed [ns]" << std::endl;
+    std::cout << nearest_time << "  " << trilinear_time << "  " << tricubic_time << "  " << precomputed_time << "  (" << sum << ")" << std::endl;
+}
+
+// the batch query against the scalar fused query, both with the precomputed coefficients
+static void benchBatch(int voxels) {
+    const double voxel_size = MAP_SIZE / voxels;
+    const int queries_count = 2000000;
+    std::vector<KDL::Vector > random_points, coherent_points;
+    generateQueries(queries_count, random_points, coherent_points);
+
+    ReachabilityMap::DistanceMapParams edt_params;
+    edt_params.method_ = ReachabilityMap::DistanceMapParams::METHOD_EDT;
+    ReachabilityMap edt_map(voxel_size, 3);
+    edt_map.setCoefficientCache(ReachabilityMap::COEFF_CACHE_PRECOMPUTED, 0);
+    edt_map.createDistanceMap(MAP_ORIGIN, sceneCollision, MAP_LOWER, MAP_UPPER, edt_params);
+
+    std::vector<double > x(queries_count), y(queries_count), z(queries_count);
+    std::vector<double > distance(queries_count), gx(queries_count), gy(queries_count), gz(queries_count);
+    std::vector<unsigned char > valid(queries_count);
+    std::cout << "queries   scalar [ns]  batch [ns]" << std::endl;
+    for (int coherent = 0; coherent < 2; coherent++) {
+        const std::vector<KDL::Vector > &points = (coherent ? coherent_points : random_points);
+        for (int i = 0; i < queries_count; i++) {
+            x[i] = points[i].x();
+            y[i] = points[i].y();
+            z[i] = points[i].z();
+        }
+        double sum = 0.0;
+
+        Timer scalar_timer;
+        for (int i = 0; i < queries_count; i++) {
+            double d;
+            KDL::Vector g;
+            if (edt_map.getDistance(points[i], d, g)) {
+                sum += d + g.x();
+            }
+        }
+        double scalar_time = scalar_timer.getTime(queries_count);
+
+        Timer batch_timer;
+        edt_map.getDistances(queries_count, &x[0], &y[0], &z[0], &distance[0], &gx[0], &gy[0], &gz[0], &valid[0], 1);
+        for (int i = 0; i < queries_count; i++) {
+            if (valid[i]) {
+                sum += distance[i] + gx[i];
+            }
+        }
+        double batch_time = batch_timer.getTime(queries_count);
+
+        std::cout << (coherent ? "coherent" : "random  ") << "  " << scalar_time << "  " << batch_time << "  (" << sum << ")" << std::endl;
+    }
+}
+
+// the tricubic kernels of src/reachability_map.cpp, which have no header
+double tricubic_eval(double a[64], double x, double y, double z, int derx, int dery, int derz);
+double tricubic_eval_value(const double a[64], double x, double y, double z);
+void tricubic_eval_gradient(const double a[64], double x, double y, double z, double *f, double df[3]);
+void tricubic_eval_derivatives(const double a[64], double x, double y, double z, double *f, double df[3], double ddf[6]);
+
+// the general kernels against the Horner kernels, on random coefficients and points
+static void benchKernels() {
+    const int coeff_count = 1024;
+    const int evaluations_count = 4000000;
+    srand(1);
+    std::vector<double > coeff(coeff_count * 64);
+    for (size_t i = 0; i < coeff.size(); i++) {
+        coeff[i] = 2.0 * randomUnit() - 1.0;
+    }
+    std::vector<double > u(evaluations_count), v(evaluations_count), w(evaluations_count);
+    for (int i = 0; i < evaluations_count; i++) {
+        u[i] = randomUnit();
+        v[i] = randomUnit();
+        w[i] = randomUnit();
+    }
+
+    double sum = 0.0;
+    double max_error = 0.0;
+
+    // tricubic_eval calls pow() for each term, so it is timed on fewer points
+    const int general_count = evaluations_count / 64;
+    Timer eval_timer;
+    for (int i = 0; i < general_count; i++) {
+        sum += tricubic_eval(&coeff[(i % coeff_count) * 64], u[i], v[i], w[i], 0, 0, 0);
+    }
+    double eval_time = eval_timer.getTime(general_count);
+
+    Timer value_timer;
+    for (int i = 0; i < evaluations_count; i++) {
+        sum += tricubic_eval_value(&coeff[(i % coeff_count) * 64], u[i], v[i], w[i]);
+    }
+    double value_time = value_timer.getTime(evaluations_count);
+
+    Timer derivatives_timer;
+    for (int i = 0; i < evaluations_count; i++) {
+        double f, df[3], ddf[6];
+        tricubic_eval_derivatives(&coeff[(i % coeff_count) * 64], u[i], v[i], w[i], &f, df, ddf);
+        sum += f + df[0] + df[1] + df[2];
+    }
+    double derivatives_time = derivatives_timer.getTime(evaluations_count);
+
+    Timer gradient_timer;
+    for (int i = 0; i < evaluations_count; i++) {
+        double f, df[3];
+        tricubic_eval_gradient(&coeff[(i % coeff_count) * 64], u[i], v[i], w[i], &f, df);
+        sum += f + df[0] + df[1] + df[2];
+    }
+    double gradient_time = gradient_timer.getTime(evaluations_count);
+
+    for (int i = 0; i < general_count; i++) {
+        double *a = &coeff[(i % coeff_count) * 64];
+        double f, df[3], ddf[6], horner_f, horner_df[3];
+        tricubic_eval_derivatives(a, u[i], v[i], w[i], &f, df, ddf);
+        tricubic_eval_gradient(a, u[i], v[i], w[i], &horner_f, horner_df);
+        max_error = std::max(max_error, std::fabs(tricubic_eval(a, u[i], v[i], w[i], 0, 0, 0) - tricubic_eval_value(a, u[i], v[i], w[i])));
+        max_error = std::max(max_error, std::fabs(f - horner_f));
+        for (int k = 0; k < 3; k++) {
+            max_error = std::max(max_error, std::fabs(df[k] - horner_df[k]));
+        }
+    }
+
+    std::cout << "value     tricubic_eval [ns]  " << eval_time << "  Horner [ns]  " << value_time << std::endl;
+    std::cout << "gradient  eval_derivatives [ns]  " << derivatives_time << "  Horner [ns]  " << gradient_time << std::endl;
+    std::cout << "max difference  " << max_error << "  (" << sum << ")" << std::endl;
+}
+
+static const double LINK_LENGTH = 0.2;
+
+// URDF of a serial chain of dof revolute joints, with the links LINK_LENGTH long;
+// the first joint of every three rotates about z and the other two about y
+static std::string serialChainUrdf(int dof, std::vector<std::string > &joint_names) {
+    std::ostringstream urdf;
+    urdf << "<?xml version=\"1.0\"?>" << std::endl;
+    urdf << "<robot name=\"chain\">" << std::endl;
+    urdf << "  <link name=\"base\"/>" << std::endl;
+    joint_names.clear();
+    for (int q_idx = 0; q_idx < dof; q_idx++) {
+        std::ostringstream joint_name;
+        joint_name << "joint" << (q_idx + 1);
+        joint_names.push_back(joint_name.str());
+        urdf << "  <link name=\"link" << (q_idx + 1) << "\"/>" << std::endl;
+        urdf << "  <joint name=\"" << joint_name.str() << "\" type=\"revolute\">" << std::endl;
+        if (q_idx == 0) {
+            urdf << "    <parent link=\"base\"/>" << std::endl;
+        }
+        else {
+            urdf << "    <parent link=\"link" << q_idx << "\"/>" << std::endl;
+        }
+        urdf << "    <child link=\"link" << (q_idx + 1) << "\"/>" << std::endl;
+        urdf << "    <origin xyz=\"0 0 " << (q_idx == 0 ? 0.0 : LINK_LENGTH) << "\" rpy=\"0 0 0\"/>" << std::endl;
+        urdf << "    <axis xyz=\"" << (q_idx % 3 == 0 ? "0 0 1" : "0 1 0") << "\"/>" << std::endl;
+        urdf << "    <limit lower=\"-2.9\" upper=\"2.9\" effort=\"10\" velocity=\"1\"/>" << std::endl;
+        urdf << "  </joint>" << std::endl;
+    }
+    urdf << "  <link name=\"effector\"/>" << std::endl;
+    urdf << "  <joint name=\"effector_joint\" type=\"fixed\">" << std::endl;
+    urdf << "    <parent link=\"link" << dof << "\"/>" << std::endl;
+    urdf << "    <child link=\"effector\"/>" << std::endl;
+    urdf << "    <origin xyz=\"0 0 " << LINK_LENGTH << "\" rpy=\"0 0 0\"/>" << std::endl;
+    urdf << "  </joint>" << std::endl;
+    urdf << "</robot>" << std::endl;
+    return urdf.str();
+}
+
+// fraction of the occupied voxels of reference that are occupied in map; the streaming
+// maps are aligned to multiples of voxel_size, so their voxels are checked at the same centres
+static double getCoverage(const ReachabilityMap &map, const ReachabilityMap &reference, double voxel_size, double reach) {
+    int half_steps = static_cast<int >(ceil(reach / voxel_size));
+    int reference_count = 0;
+    int covered_count = 0;
+    Eigen::Vector3d x;
+    for (int ix = -half_steps; ix < half_steps; ix++) {
+        x(0) = (ix + 0.5) * voxel_size;
+        for (int iy = -half_steps; iy < half_steps; iy++) {
+            x(1) = (iy + 0.5) * voxel_size;
+            for (int iz = -half_steps; iz < half_steps; iz++) {
+                x(2) = (iz + 0.5) * voxel_size;
+                if (reference.getValue<3 >(x) > 0.0) {
+                    reference_count++;
+                    if (map.getValue<3 >(x) > 0.0) {
+                        covered_count++;
+                    }
+                }
+            }
+        }
+    }
+    return (reference_count == 0 ? 0.0 : static_cast<double >(covered_count) / reference_count);
+}
+
+// coverage of the reference map against the number of samples, for the joint-space samplers
+static void benchSampler(int dof, int reference_samples) {
+    const double voxel_size = 0.05;
+    const double reach = (dof + 1) * LINK_LENGTH;
+    std::vector<std::string > joint_names;
+    boost::shared_ptr<KinematicModel> kin_model( new KinematicModel(serialChainUrdf(dof, joint_names), joint_names) );
+
+    ReachabilityMap::GenerationParams params;
+    params.streaming_ = true;
+    params.lower_bound_ = Eigen::VectorXd::Constant(3, -reach);
+    params.upper_bound_ = Eigen::VectorXd::Constant(3, reach);
+
+    ReachabilityMap reference(voxel_size, 3);
+    params.samples_count_ = reference_samples;
+    params.seed_ = 12345;
+    Timer reference_timer;
+    reference.generateForArm(kin_model, "base", "effector", params);
+    std::cout << "reference map: " << reference_samples << " samples, " << reference.getGenerationStats().occupied_voxels_count_
+        << " voxels, " << reference_timer.getTime(1) / 1.0e9 << " s" << std::endl;
+    params.seed_ = 1;
+
+    const int samples_counts_3dof[4] = {20000, 50000, 100000, 200000};
+    const int samples_counts_6dof[4] = {100000, 300000, 1000000, 3000000};
+    const int *samples_counts = (dof <= 3 ? samples_counts_3dof : samples_counts_6dof);
+    std::cout << "samples   uniform  halton  scrambled" << std::endl;
+    for (int count_idx = 0; count_idx < 4; count_idx++) {
+        params.samples_count_ = samples_counts[count_idx];
+        std::cout << params.samples_count_;
+        for (int sampler_idx = 0; sampler_idx < 3; sampler_idx++) {
+            params.sampler_ = (sampler_idx == 0 ? ReachabilityMap::GenerationParams::SAMPLER_UNIFORM : ReachabilityMap::GenerationParams::SAMPLER_HALTON);
+            params.scrambled_ = (sampler_idx == 2);
+            ReachabilityMap map(voxel_size, 3);
+            map.generateForArm(kin_model, "base", "effector", params);
+            std::cout << "  " << getCoverage(map, reference, voxel_size, reach);
+        }
+        std::cout << std::endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cout << "usage: " << argv[0] << " layout [voxels]" << std::endl;
+        std::cout << "       " << argv[0] << " interpolation [voxels]" << std::endl;
+        std::cout << "       " << argv[0] << " batch [voxels]" << std::endl;
+        std::cout << "       " << argv[0] << " kernels" << std::endl;
+        std::cout << "       " << argv[0] << " sampler [dof] [reference_samples]" << std::endl;
+        return 1;
+    }
+    if (strcmp(argv[1], "layout") == 0) {
+        benchLayout(argc > 2 ? atoi(argv[2]) : 200);
+    }
+    else if (strcmp(argv[1], "interpolation") == 0) {
+        benchInterpolation(argc > 2 ? atoi(argv[2]) : 120);
+    }
+    else if (strcmp(argv[1], "batch") == 0) {
+        benchBatch(argc > 2 ? atoi(argv[2]) : 80);
+    }
+    else if (strcmp(argv[1], "kernels") == 0) {
+        benchKernels();
+    }
+    else if (strcmp(argv[1], "sampler") == 0) {
+        benchSampler(argc > 2 ? atoi(argv[2]) : 3, argc > 3 ? atoi(argv[3]) : 8000000);
+    }
+    else {
+        std::cout << "ERROR: unknown benchmark: " << argv[1] << std::endl;
+        return 1;
+    }
+    return 0;
+}
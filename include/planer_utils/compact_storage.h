@@ -0,0 +1,484 @@
+// Copyright (c) 2015, Robot Control and Pattern Recognition Group,
+// Institute of Control and Computation Engineering
+// Warsaw University of Technology
+//
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Warsaw University of Technology nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYright HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Author: Dawid Seredynski
+//
+
+
+#ifndef COMPACT_STORAGE_H__
+#define COMPACT_STORAGE_H__
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <boost/cstdint.hpp>
+
+#include "voxel_storage.h"
+
+// Voxel grid of distances in one of the encodings:
+// ENCODING_FLOAT64 keeps doubles,
+// ENCODING_FLOAT32 keeps floats (24-bit mantissa), with the relative error up to 6e-8 (about 7 significant digits),
+// ENCODING_FIXED16 keeps 16-bit integer multiples of resolution, with the absolute error
+// up to resolution/2; the values beyond +-32767*resolution are saturated, and the negative
+// values are at most -resolution, so they keep their sign. The interpolated
+// gradient then has the error of about resolution/voxel_size relative to its norm.
+// Only the FLOAT64 grid refers to memory-mapped data, the other encodings convert it.
+class DistanceStorage {
+public:
+    enum Encoding { ENCODING_FLOAT64, ENCODING_FLOAT32, ENCODING_FIXED16 };
+
+    typedef double value_type;
+
+    // element of the non-const grid, encoded when it is assigned
+    class Reference {
+    public:
+        Reference(DistanceStorage &storage, size_t idx) :
+            storage_(storage),
+            idx_(idx)
+        {
+        }
+
+        operator double() const {
+            return storage_.get(idx_);
+        }
+
+        Reference &operator=(double value) {
+            storage_.set(idx_, value);
+            return *this;
+        }
+
+        Reference &operator=(const Reference &ref) {
+            storage_.set(idx_, ref.storage_.get(ref.idx_));
+            return *this;
+        }
+
+    private:
+        DistanceStorage &storage_;
+        size_t idx_;
+    };
+
+    DistanceStorage() :
+        encoding_(ENCODING_FLOAT64),
+        resolution_(1.0),
+        sparse_(false),
+        stride_(1),
+        background_(0.0)
+    {
+    }
+
+    // re-encodes the stored values
+    void setEncoding(Encoding encoding, double resolution) {
+        if (encoding == encoding_ && (encoding != ENCODING_FIXED16 || resolution == resolution_)) {
+            resolution_ = resolution;
+            return;
+        }
+        DistanceStorage storage;
+        storage.setSparse(sparse_);
+        storage.encoding_ = encoding;
+        storage.resolution_ = resolution;
+        storage.reset(steps_, stride_, background_);
+        for (size_t idx = 0; idx < size(); idx++) {
+            double value = get(idx);
+            if (value != background_) {
+                storage.set(idx, value);
+            }
+        }
+        *this = storage;
+    }
+
+    Encoding getEncoding() const {
+        return encoding_;
+    }
+
+    double getResolution() const {
+        return resolution_;
+    }
+
+    void setSparse(bool sparse) {
+        sparse_ = sparse;
+        f64_.setSparse(sparse);
+        f32_.setSparse(sparse);
+        i16_.setSparse(sparse);
+    }
+
+    bool isSparse() const {
+        return f64_.isSparse() || f32_.isSparse() || i16_.isSparse();
+    }
+
+    void reset(const std::vector<int > &steps, int stride, double value) {
+        steps_ = steps;
+        stride_ = stride;
+        background_ = value;
+        switch (encoding_) {
+        case ENCODING_FLOAT64:
+            f64_.reset(steps, stride, value);
+            break;
+        case ENCODING_FLOAT32:
+            f32_.reset(steps, stride, static_cast<float >(value));
+            break;
+        case ENCODING_FIXED16:
+            i16_.reset(steps, stride, encodeFixed(value, resolution_));
+            break;
+        }
+    }
+
+    void fill(double value) {
+        reset(steps_, stride_, value);
+    }
+
+    void clear() {
+        steps_.clear();
+        stride_ = 1;
+        background_ = 0.0;
+        f64_.clear();
+        f32_.clear();
+        i16_.clear();
+    }
+
+    void map(const std::vector<int > &steps, int stride, const double *data, double background) {
+        if (encoding_ == ENCODING_FLOAT64) {
+            steps_ = steps;
+            stride_ = stride;
+            background_ = background;
+            f64_.map(steps, stride, data, background);
+            return;
+        }
+        reset(steps, stride, background);
+        for (size_t idx = 0; idx < size(); idx++) {
+            if (data[idx] != background) {
+                set(idx, data[idx]);
+            }
+        }
+    }
+
+    void detach() {
+        f64_.detach();
+    }
+
+    bool isMapped() const {
+        return f64_.isMapped();
+    }
+
+    size_t size() const {
+        return f64_.size() + f32_.size() + i16_.size();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // the dense FLOAT64 data, or NULL
+    const double *data() const {
+        return encoding_ == ENCODING_FLOAT64 ? f64_.data() : NULL;
+    }
+
+    void copyTo(std::vector<double > &v) const {
+        v.resize(size());
+        for (size_t idx = 0; idx < v.size(); idx++) {
+            v[idx] = get(idx);
+        }
+    }
+
+    int getBlocksCount() const {
+        return f64_.getBlocksCount() + f32_.getBlocksCount() + i16_.getBlocksCount();
+    }
+
+    size_t getMemoryUsage() const {
+        return f64_.getMemoryUsage() + f32_.getMemoryUsage() + i16_.getMemoryUsage();
+    }
+
+    double operator[](size_t idx) const {
+        return get(idx);
+    }
+
+    Reference operator[](size_t idx) {
+        return Reference(*this, idx);
+    }
+
+    double get(size_t idx) const {
+        if (encoding_ == ENCODING_FLOAT64) {
+            return f64_[idx];
+        }
+        else if (encoding_ == ENCODING_FLOAT32) {
+            return f32_[idx];
+        }
+        return i16_[idx] * resolution_;
+    }
+
+    // the value stored by ENCODING_FIXED16 with the resolution
+    static double roundFixed(double value, double resolution) {
+        return encodeFixed(value, resolution) * resolution;
+    }
+
+    // reads the values of count indices, with the encoding dispatched once for all of them
+    void gather(const int *indices, int count, double *values) const {
+        switch (encoding_) {
+        case ENCODING_FLOAT32:
+            f32_.gather(indices, count, values);
+            break;
+        case ENCODING_FIXED16:
+            i16_.gather(indices, count, values);
+            for (int i = 0; i < count; i++) {
+                values[i] *= resolution_;
+            }
+            break;
+        default:
+            f64_.gather(indices, count, values);
+            break;
+        }
+    }
+
+    void set(size_t idx, double value) {
+        switch (encoding_) {
+        case ENCODING_FLOAT32:
+            f32_.set(idx, static_cast<float >(value));
+            break;
+        case ENCODING_FIXED16:
+            i16_.set(idx, encodeFixed(value, resolution_));
+            break;
+        default:
+            f64_.set(idx, value);
+            break;
+        }
+    }
+
+protected:
+    static boost::int16_t encodeFixed(double value, double resolution) {
+        double q = std::floor(value / resolution + 0.5);
+        if (value < 0.0) {
+            q = std::min(-1.0, q);
+        }
+        return static_cast<boost::int16_t >(std::max(-32767.0, std::min(32767.0, q)));
+    }
+
+    Encoding encoding_;
+    double resolution_;
+    bool sparse_;
+    std::vector<int > steps_;
+    int stride_;
+    double background_;
+    VoxelStorage<double > f64_;
+    VoxelStorage<float > f32_;
+    VoxelStorage<boost::int16_t > i16_;
+};
+
+// Voxel grid of non-negative counters, kept as ENCODING_INT32 ints or as ENCODING_UINT16
+// 16-bit unsigned integers, saturated at 65535. Only the INT32 grid refers
+// to memory-mapped data, the UINT16 encoding converts it.
+class CounterStorage {
+public:
+    enum Encoding { ENCODING_INT32, ENCODING_UINT16 };
+
+    typedef int value_type;
+
+    // element of the non-const grid, saturated when it is assigned
+    class Reference {
+    public:
+        Reference(CounterStorage &storage, size_t idx) :
+            storage_(storage),
+            idx_(idx)
+        {
+        }
+
+        operator int() const {
+            return storage_.get(idx_);
+        }
+
+        Reference &operator=(int value) {
+            storage_.set(idx_, value);
+            return *this;
+        }
+
+        Reference &operator=(const Reference &ref) {
+            storage_.set(idx_, ref.storage_.get(ref.idx_));
+            return *this;
+        }
+
+        Reference &operator+=(int value) {
+            storage_.set(idx_, storage_.get(idx_) + value);
+            return *this;
+        }
+
+    private:
+        CounterStorage &storage_;
+        size_t idx_;
+    };
+
+    CounterStorage() :
+        encoding_(ENCODING_INT32),
+        sparse_(false),
+        stride_(1),
+        background_(0)
+    {
+    }
+
+    // re-encodes the stored values
+    void setEncoding(Encoding encoding) {
+        if (encoding == encoding_) {
+            return;
+        }
+        CounterStorage storage;
+        storage.setSparse(sparse_);
+        storage.encoding_ = encoding;
+        storage.reset(steps_, stride_, background_);
+        for (size_t idx = 0; idx < size(); idx++) {
+            int value = get(idx);
+            if (value != background_) {
+                storage.set(idx, value);
+            }
+        }
+        *this = storage;
+    }
+
+    Encoding getEncoding() const {
+        return encoding_;
+    }
+
+    void setSparse(bool sparse) {
+        sparse_ = sparse;
+        i32_.setSparse(sparse);
+        u16_.setSparse(sparse);
+    }
+
+    bool isSparse() const {
+        return i32_.isSparse() || u16_.isSparse();
+    }
+
+    void reset(const std::vector<int > &steps, int stride, int value) {
+        steps_ = steps;
+        stride_ = stride;
+        background_ = value;
+        if (encoding_ == ENCODING_INT32) {
+            i32_.reset(steps, stride, value);
+        }
+        else {
+            u16_.reset(steps, stride, saturate(value));
+        }
+    }
+
+    void fill(int value) {
+        reset(steps_, stride_, value);
+    }
+
+    void clear() {
+        steps_.clear();
+        stride_ = 1;
+        background_ = 0;
+        i32_.clear();
+        u16_.clear();
+    }
+
+    void map(const std::vector<int > &steps, int stride, const int *data, int background) {
+        if (encoding_ == ENCODING_INT32) {
+            steps_ = steps;
+            stride_ = stride;
+            background_ = background;
+            i32_.map(steps, stride, data, background);
+            return;
+        }
+        reset(steps, stride, background);
+        for (size_t idx = 0; idx < size(); idx++) {
+            if (data[idx] != background) {
+                set(idx, data[idx]);
+            }
+        }
+    }
+
+    void detach() {
+        i32_.detach();
+    }
+
+    bool isMapped() const {
+        return i32_.isMapped();
+    }
+
+    size_t size() const {
+        return i32_.size() + u16_.size();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // the dense INT32 data, or NULL
+    const int *data() const {
+        return encoding_ == ENCODING_INT32 ? i32_.data() : NULL;
+    }
+
+    void copyTo(std::vector<int > &v) const {
+        v.resize(size());
+        for (size_t idx = 0; idx < v.size(); idx++) {
+            v[idx] = get(idx);
+        }
+    }
+
+    int getBlocksCount() const {
+        return i32_.getBlocksCount() + u16_.getBlocksCount();
+    }
+
+    size_t getMemoryUsage() const {
+        return i32_.getMemoryUsage() + u16_.getMemoryUsage();
+    }
+
+    int operator[](size_t idx) const {
+        return get(idx);
+    }
+
+    Reference operator[](size_t idx) {
+        return Reference(*this, idx);
+    }
+
+    int get(size_t idx) const {
+        return encoding_ == ENCODING_INT32 ? i32_[idx] : u16_[idx];
+    }
+
+    void set(size_t idx, int value) {
+        if (encoding_ == ENCODING_INT32) {
+            i32_.set(idx, value);
+        }
+        else {
+            u16_.set(idx, saturate(value));
+        }
+    }
+
+protected:
+    static boost::uint16_t saturate(int value) {
+        return static_cast<boost::uint16_t >(std::max(0, std::min(65535, value)));
+    }
+
+    Encoding encoding_;
+    bool sparse_;
+    std::vector<int > steps_;
+    int stride_;
+    int background_;
+    VoxelStorage<int > i32_;
+    VoxelStorage<boost::uint16_t > u16_;
+};
+
+#endif  // COMPACT_STORAGE_H__
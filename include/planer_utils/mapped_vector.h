@@ -0,0 +1,140 @@
+// Copyright (c) 2015, Robot Control and Pattern Recognition Group,
+// Institute of Control and Computation Engineering
+// Warsaw University of Technology
+//
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Warsaw University of Technology nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYright HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Author: Dawid Seredynski
+//
+
+#ifndef MAPPED_VECTOR_H__
+#define MAPPED_VECTOR_H__
+
+#include <vector>
+#include <cstddef>
+
+// Array that either owns its elements or refers to read-only memory owned by someone else,
+// e.g. a memory-mapped file. The const accessors read the data in place; any non-const
+// access to referenced data makes a private copy first.
+template <typename T >
+class MappedVector {
+public:
+    MappedVector() :
+        data_(NULL),
+        size_(0),
+        mapped_(false)
+    {
+    }
+
+    MappedVector(const MappedVector &v) :
+        vec_(v.begin(), v.end())
+    {
+        update();
+    }
+
+    MappedVector &operator=(const MappedVector &v) {
+        if (this != &v) {
+            vec_.assign(v.begin(), v.end());
+            update();
+        }
+        return *this;
+    }
+
+    void map(const T *data, size_t size) {
+        std::vector<T >().swap(vec_);
+        data_ = data;
+        size_ = size;
+        mapped_ = true;
+    }
+
+    void detach() {
+        if (mapped_) {
+            vec_.assign(data_, data_ + size_);
+            update();
+        }
+    }
+
+    bool isMapped() const {
+        return mapped_;
+    }
+
+    void resize(size_t size, const T &value = T()) {
+        detach();
+        vec_.resize(size, value);
+        update();
+    }
+
+    void assign(size_t size, const T &value) {
+        vec_.assign(size, value);
+        update();
+    }
+
+    void clear() {
+        std::vector<T >().swap(vec_);
+        update();
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    const T *begin() const {
+        return data_;
+    }
+
+    const T *end() const {
+        return data_ + size_;
+    }
+
+    const T &operator[](size_t idx) const {
+        return data_[idx];
+    }
+
+    T &operator[](size_t idx) {
+        if (mapped_) {
+            detach();
+        }
+        return vec_[idx];
+    }
+
+protected:
+    void update() {
+        data_ = vec_.empty() ? NULL : &vec_[0];
+        size_ = vec_.size();
+        mapped_ = false;
+    }
+
+    std::vector<T > vec_;
+    const T *data_;
+    size_t size_;
+    bool mapped_;
+};
+
+#endif  // MAPPED_VECTOR_H__
+
@@ -33,12 +33,23 @@
 #define REACHABILITY_MAP_H__
 
 #include "Eigen/Dense"
+#include <cmath>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
 
 #include "reachability_map.h"
+#include "voxel_storage.h"
+#include "compact_storage.h"
 #include <collision_convex_model/collision_convex_model.h>
 #include "kin_dyn_model/kin_model.h"
 
-class ReachabilityMap {
+namespace boost {
+namespace interprocess {
+class mapped_region;
+}
+}
+
+class ReachabilityMap : private boost::noncopyable {
 public:
     class GradientInfo {
     public:
@@ -47,21 +58,123 @@ public:
         bool valid_;
     };
 
-    ReachabilityMap(double voxel_size, int dim);
+    // Parameters of the sampling-based map generation.
+    // The samples are drawn in fixed-size chunks, each chunk with its own random stream
+    // seeded with (seed_, chunk index), so the resulting map depends only on the seed
+    // and not on the number of threads.
+    // threads_count_ is 1 by default. More threads share kin_model and col_model, so they
+    // may be used only if calculateFk of the kinematic model and the const methods of
+    // the collision model are thread-safe.
+    // In the streaming mode the endpoints are not stored: each sample is binned at once into
+    // a grid aligned to multiples of voxel_size, which is grown when a sample falls outside.
+    // The optional lower_bound_ and upper_bound_ give its initial extent.
+    // In the adaptive mode (batch_size_ > 0) the samples are binned as in the streaming mode,
+    // and after every batch the map is compared with the map from the previous batch.
+    // The sampling stops when both the fraction of newly occupied voxels and the L1 change
+    // of the normalized histogram fall below tolerance_, when time_budget_ [s] is exceeded,
+    // or after samples_count_ samples.
+    // SAMPLER_HALTON draws the joint configurations from the Halton sequence instead of
+    // the random streams; with scrambled_ set, its digits are permuted with random
+    // permutations (seeded with seed_), which breaks the correlations between
+    // the high-dimensional components.
+    // With orientation_resolution_ n > 0, the reached orientations of the effector are also
+    // recorded for each voxel, as a bitset of 4*n^3 orientation bins.
+    class GenerationParams {
+    public:
+        enum SamplerType { SAMPLER_UNIFORM, SAMPLER_HALTON };
+
+        GenerationParams();
+        int samples_count_;
+        int threads_count_;
+        unsigned int seed_;
+        bool streaming_;
+        Eigen::VectorXd lower_bound_;
+        Eigen::VectorXd upper_bound_;
+        int batch_size_;
+        double tolerance_;
+        double time_budget_;
+        SamplerType sampler_;
+        bool scrambled_;
+        int orientation_resolution_;
+    };
+
+    class GenerationStats {
+    public:
+        GenerationStats();
+        int samples_count_;
+        int valid_samples_count_;
+        int batches_count_;
+        int occupied_voxels_count_;
+        double new_voxels_fraction_;
+        double l1_change_;
+        bool converged_;
+        double time_;
+        std::vector<int > batch_samples_count_;
+        std::vector<int > batch_occupied_voxels_count_;
+    };
+
+    // Parameters of the distance map.
+    // METHOD_BFS grows the distance from the origin through the free space, adding voxel_size
+    // between 6-neighbouring voxels, which gives the Manhattan geodesic distance.
+    // METHOD_EDT computes the exact Euclidean distance transform of the obstacles in O(N) time:
+    // the signed distance to the obstacle surface, positive in the free space and negative
+    // inside obstacles; the origin is only stored. The scanlines of the transform are split
+    // between threads_count_ threads.
+    // gradient_field_ also stores the descent direction of every voxel (see getVoxelGradient),
+    // computed by threads_count_ threads; it takes 1 B per voxel and is not saved in the map files.
+    // precompute_occupancy_ calls collision_func for all voxels in the bounds before the distance
+    // is computed, from threads_count_ threads at once, into a grid of 1 bit per voxel; otherwise
+    // collision_func is called from one thread, and METHOD_BFS calls it only for the voxels it
+    // reaches. With the option collision_func must be thread-safe.
+    class DistanceMapParams {
+    public:
+        enum Method { METHOD_BFS, METHOD_EDT };
+
+        DistanceMapParams();
+        Method method_;
+        int threads_count_;
+        bool gradient_field_;
+        bool precompute_occupancy_;
+    };
+
+    // The sparse map allocates the voxels in blocks, only where they are written,
+    // instead of the whole bounding box. The map is not copyable, as its coefficient cache
+    // is updated in place.
+    ReachabilityMap(double voxel_size, int dim, bool sparse=false);
 
     ~ReachabilityMap();
 
     void generate(const boost::shared_ptr<KinematicModel> &kin_model, const boost::shared_ptr<self_collision::CollisionModel> &col_model, const std::string &effector_name, int ndof, const Eigen::VectorXd &lower_limit, const Eigen::VectorXd &upper_limit);
     void generateForArm(const boost::shared_ptr<KinematicModel> &kin_model, const std::string &base_name, const std::string &effector_name);
+
+    // with params.threads_count_ > 1, kin_model and col_model are shared by all threads,
+    // so their const methods must be thread-safe
+    void generate(const boost::shared_ptr<KinematicModel> &kin_model, const boost::shared_ptr<self_collision::CollisionModel> &col_model, const std::string &effector_name, int ndof, const Eigen::VectorXd &lower_limit, const Eigen::VectorXd &upper_limit, const GenerationParams &params);
+    void generateForArm(const boost::shared_ptr<KinematicModel> &kin_model, const std::string &base_name, const std::string &effector_name, const GenerationParams &params);
+    const GenerationStats &getGenerationStats() const;
     void generate(const Eigen::VectorXd &lower_bound, const Eigen::VectorXd &upper_bound);
 
     void clear();
     double getValue(const Eigen::VectorXd &x) const;
+
+    // getValue of a 2-D or 3-D map (Dim == dim) for a fixed-size vector, without the heap
+    // allocation of Eigen::VectorXd; the index math is unrolled for Dim
+    template <int Dim >
+    double getValue(const Eigen::Matrix<double, Dim, 1 > &x) const;
+
+    // these require the map generated with orientation_resolution_ > 0
+    double getValue(const Eigen::VectorXd &x, const KDL::Rotation &rot) const;
+    double getOrientationCoverage(const Eigen::VectorXd &x) const;
     void setValue(const Eigen::VectorXd &x, int value);
 
     void getNeighbourIndices(const std::vector<int> &d, std::list<int> &n_indices);
     void grow();
 
+    // the same as voxels calls of grow(), for any dimension: adds voxels - max(d, 1) + 1 to the voxels
+    // at the Manhattan distance d <= voxels from the reachable voxels. The distance transform runs
+    // in one pass per axis, with the columns of the grid split between threads_count threads.
+    void grow(int voxels, int threads_count);
+
     void addMap(const ReachabilityMap &map);
     void addMap(const boost::shared_ptr<ReachabilityMap > &pmap);
 
@@ -71,30 +184,182 @@ public:
     double getMaxValue() const;
 
     bool createDistanceMap(const KDL::Vector &origin, boost::function<bool(const KDL::Vector &x)> collision_func, const KDL::Vector &lower_bound, const KDL::Vector &upper_bound);
+    bool createDistanceMap(const KDL::Vector &origin, boost::function<bool(const KDL::Vector &x)> collision_func, const KDL::Vector &lower_bound, const KDL::Vector &upper_bound, const DistanceMapParams &params);
+
+    // the number of voxels of the distance map created for the bounds, in each axis
+    void getDistanceMapSize(const KDL::Vector &lower_bound, const KDL::Vector &upper_bound, int &nx, int &ny, int &nz) const;
+
+    // Distance map of a prebuilt occupancy grid of the nx*ny*nz voxels given by getDistanceMapSize,
+    // in the row-major order (z changes fastest). The voxel (ix, iy, iz), with the centre at
+    // lower_bound + ((ix, iy, iz) + 0.5) * voxel_size, is in collision if its bit of the bitset
+    // (bit idx % 64 of the word idx / 64) or its byte of the byte grid is not 0.
+    // Returns false if the grid has a wrong size.
+    bool createDistanceMap(const KDL::Vector &origin, const std::vector<boost::uint64_t > &occupancy, const KDL::Vector &lower_bound, const KDL::Vector &upper_bound, const DistanceMapParams &params=DistanceMapParams());
+    bool createDistanceMap(const KDL::Vector &origin, const std::vector<unsigned char > &occupancy, const KDL::Vector &lower_bound, const KDL::Vector &upper_bound, const DistanceMapParams &params=DistanceMapParams());
+
+    // Distance map of a batched collision check: collision_func(count, x, collision) sets collision[i]
+    // to a non-zero value if the voxel centre x[i] is in collision, for up to 1024 centres per call.
+    // All voxels are classified before the distance is computed; with precompute_occupancy_
+    // the calls are made from threads_count_ threads, so collision_func must be thread-safe.
+    bool createDistanceMapBatched(const KDL::Vector &origin, boost::function<void(int count, const KDL::Vector *x, unsigned char *collision)> collision_func, const KDL::Vector &lower_bound, const KDL::Vector &upper_bound, const DistanceMapParams &params=DistanceMapParams());
+
+    // Incremental update of a METHOD_BFS distance map when the obstacles change: the voxels
+    // of the points in removed become free, and then the voxels of the points in added become occupied.
+    // It needs the occupancy grid of the map (1 bit per voxel), which is kept if the map was
+    // created from an occupancy grid, by createDistanceMapBatched or with precompute_occupancy_;
+    // otherwise, and for METHOD_EDT maps, it returns false. The map is repaired only where
+    // it changes: the voxels whose paths led through the new obstacles are raised, the distances
+    // are lowered from the border of the raised voxels and from the freed voxels, and the obstacles
+    // that touch the changed voxels are filled again. The map is the same as created with the new
+    // obstacles, except that getPaths may choose other paths of the same length.
+    bool updateObstacles(const std::vector<KDL::Vector > &added, const std::vector<KDL::Vector > &removed);
+    bool addObstacles(const std::vector<KDL::Vector > &points);
+    bool removeObstacles(const std::vector<KDL::Vector > &points);
+
+    bool getDistance(const KDL::Vector &x, double &distance) const;
+
+    // Interpolation policies of getDistance<Interpolation>(). InterpolationNearest takes the value
+    // of the nearest grid point, InterpolationTrilinear interpolates linearly between the 8 grid
+    // points around x, and InterpolationTricubic is the interpolation of getDistance(x, distance).
+    // All of them are defined in the same region of the map and are inlined in the caller;
+    // the nearest and trilinear ones read only the grid values, without the tricubic coefficients.
+    class InterpolationNearest;
+    class InterpolationTrilinear;
+    class InterpolationTricubic;
+
+    template <typename Interpolation >
     bool getDistance(const KDL::Vector &x, double &distance) const;
 
     bool getGradient(const KDL::Vector &x, KDL::Vector &gradient) const;
+
+    // the unit direction from the voxel of x to its neighbour (of 26) with the smallest distance;
+    // false inside obstacles and at the minima. It is a single read if the map was created
+    // with gradient_field_, otherwise the neighbours are scanned.
+    bool getVoxelGradient(const KDL::Vector &x, KDL::Vector &gradient) const;
+
+    // the distance (as getDistance), its gradient and optionally its Hessian with respect to x,
+    // from one pass over the interpolation polynomial; getGradient is the normalized -gradient
+    bool getDistance(const KDL::Vector &x, double &distance, KDL::Vector &gradient, Eigen::Matrix3d *hessian=NULL) const;
+
+    // Batch query over structure-of-arrays buffers of count points. valid[i] is set to 1 if the point
+    // can be queried, and only then distance[i] and the gradient (as in the fused getDistance) are
+    // written; gx, gy and gz may be NULL. The points are split between threads_count threads.
+    // Returns the number of valid points.
+    int getDistances(int count, const double *x, const double *y, const double *z, double *distance, double *gx, double *gy, double *gz, unsigned char *valid, int threads_count) const;
     bool getAllGradients(const KDL::Vector &x, std::vector<GradientInfo > &gradients) const;
 
+    // Flags of the distance map voxels, set by createDistanceMap. VOXEL_OBSTACLE marks the voxels
+    // in collision; METHOD_BFS checks only the voxels next to the free space reached from
+    // the origin, and marks the reached voxels with VOXEL_VISITED. The flags are not saved
+    // in the map files.
+    enum VoxelFlag { VOXEL_OBSTACLE = 1, VOXEL_VISITED = 2 };
+
+    // the VoxelFlag bits of the voxel of x, or -1 outside the map
+    int getVoxelFlags(const KDL::Vector &x) const;
+
+    // Geodesic paths of a METHOD_BFS map. The BFS stores for every voxel the direction to the voxel
+    // it was reached from (1 B per voxel); the obstacle voxels point to the neighbour their distance
+    // was taken from. paths[i] is the list of voxel centres from the voxel of starts[i] to the voxel
+    // of the origin, or empty if starts[i] is outside the map or has no path. The starts are split
+    // between threads_count threads. Returns the number of paths found.
+    int getPaths(const std::vector<KDL::Vector > &starts, std::vector<std::vector<KDL::Vector > > &paths, int threads_count) const;
+
+    // Cache of the tricubic coefficients of the distance map cells, so the repeated queries
+    // in a cell evaluate only the polynomial. COEFF_CACHE_PRECOMPUTED computes the coefficients
+    // of all cells when the distance map is created (512 B per voxel). COEFF_CACHE_LAZY stores
+    // them at the first query in a cell, for up to capacity cells (0 means no limit), dropping
+    // the least recently used ones; it is shared by the threads that query the map, and split
+    // into shards with their own locks, so they seldom wait for each other.
+    enum CoefficientCacheType { COEFF_CACHE_NONE, COEFF_CACHE_PRECOMPUTED, COEFF_CACHE_LAZY };
+    void setCoefficientCache(CoefficientCacheType type, int capacity);
+
+    // Memory layout of the dense distance map. LAYOUT_BRICKS stores it in bricks of brick_size^3
+    // voxels (brick_size is a power of two), padded to whole bricks, so the 4x4x4 neighbourhood
+    // of the interpolation spans fewer cache lines and pages. The sparse map is always stored
+    // in blocks, in the row-major order of the map. The existing distance map is converted.
+    // The map files hold the row-major map, so loading a file into bricks copies it.
+    enum DistanceMapLayout { LAYOUT_ROW_MAJOR, LAYOUT_BRICKS };
+    void setDistanceMapLayout(DistanceMapLayout layout, int brick_size);
+
     const KDL::Vector &getOrigin() const;
 
     void printDistanceMap() const;
 
+    // Binary map file. The arrays are stored in the native byte order, aligned to 64 bytes,
+    // so a memory-mapped file is queried in place and shared with other processes
+    // through the page cache. Modifying a memory-mapped map makes a private copy of its data.
+    // Only maps of up to 3 dimensions are supported. The map is not changed if load fails.
+    bool save(const std::string &filename) const;
+    bool load(const std::string &filename, bool memory_mapped);
+
+    // Encodings of the distance map and of the reachability counters and penalties (see
+    // DistanceStorage and CounterStorage); the maps are converted at once. The distance map
+    // is computed in double precision and encoded when it is finished, so the errors of
+    // the encoding do not accumulate; the counters are saturated as they are accumulated.
+    // The interpolated distance inherits the error of the encoding. The FIXED16 resolution must
+    // keep the distances -1 (not reached) and -2 (obstacle) of METHOD_BFS apart, so it is between
+    // 1/32767 and 4/3 (exclusive); otherwise the storage is not changed.
+    // The map files always hold FLOAT64 distances and INT32 counters.
+    void setStorage(DistanceStorage::Encoding distance_encoding, double distance_resolution, CounterStorage::Encoding counter_encoding);
+
+    // memory allocated for the voxel data [B]
+    size_t getMemoryUsage() const;
+
 protected:
 
-    class Derivatives {
-    public:
-        double dx_, dy_, dz_;
-        double ddx_, ddy_, ddz_;
-    };
+    class SamplingTask;
+    class SamplingWorker;
+    class HaltonSequence;
+    class CoefficientCache;
+    class DistanceBatch;
+    class DistanceOverlay;
+
+    void generateFromSamples(const SamplingTask &task, const GenerationParams &params);
+    void runSampling(const std::vector<boost::shared_ptr<SamplingWorker > > &workers, int chunk_begin, int chunk_end, const GenerationParams &params);
+    void mergeStreamingGrids(const std::vector<boost::shared_ptr<SamplingWorker > > &workers);
+    void mergeBufferedSamples(const std::vector<boost::shared_ptr<SamplingWorker > > &workers);
+    void updateConvergence(const std::vector<int > &prev_map, const std::vector<int > &prev_min, const std::vector<int > &prev_steps, double tolerance);
+
+    static int getOrientationBin(const KDL::Rotation &rot, int resolution);
+
+    bool initDistanceMap(const KDL::Vector &origin, const KDL::Vector &lower_bound, const KDL::Vector &upper_bound);
+    void finishDistanceMap(boost::function<bool(const KDL::Vector &x)> collision_func, const std::vector<boost::uint64_t > *occupancy, const DistanceMapParams &params);
+    void computeOccupancy(boost::function<void(int count, const KDL::Vector *x, unsigned char *collision)> collision_func, int threads_count, std::vector<boost::uint64_t > &occupancy) const;
+    void computeOccupancyChunks(boost::function<void(int count, const KDL::Vector *x, unsigned char *collision)> collision_func, int chunk_begin, int chunk_end, int chunk_step, std::vector<boost::uint64_t > *occupancy) const;
+    void createEuclideanDistanceMap(const std::vector<boost::uint64_t > &occupancy, int threads_count);
+    void squaredDistanceTransform(std::vector<double > &grid, int threads_count) const;
 
     void tricubic_get_coeff(double a[64], int ix, int iy, int iz) const;
+    void getCoefficients(double a[64], int ix, int iy, int iz) const;
+    const double *getPrecomputedCoefficients(int ix, int iy, int iz) const;
+    double getTricubicDistance(int ix, int iy, int iz, double u, double v, double w) const;
+    void resetCoefficientCache();
+    void getDistancesRange(const DistanceBatch &batch, int begin, int end, int *valid_count) const;
 
     bool getGradient(int idx, KDL::Vector &gradient) const;
-    void recurenceGrow(const std::list<Eigen::Vector3i > &states_to_expand, boost::function<bool(const KDL::Vector &x)> collision_func, const KDL::Vector &lower_bound, const KDL::Vector &upper_bound);
+    int getFlags(int idx) const;
+    void getPathsRange(const std::vector<KDL::Vector > &starts, std::vector<std::vector<KDL::Vector > > &paths, int begin, int end, int *found_count) const;
+    unsigned char scanDescent(int idx) const;
+    void createGradientField(int threads_count);
+    void computeGradientField(int ix_begin, int ix_end, std::vector<std::pair<int, unsigned char > > *gradients);
+    void growDistance(int origin_idx, boost::function<bool(const KDL::Vector &x)> collision_func, const std::vector<boost::uint64_t > *occupancy);
+    double getMaxNeighbourDistance(const DistanceOverlay &distances, int ix, int iy, int iz, int &max_idx) const;
+    void fillObstacleDistance();
+    void fillObstacleDistance(DistanceOverlay &distances, std::vector<int > &candidates);
+    void repairDistanceMap(const std::vector<int > &toggled, std::vector<int > &changed);
+    void updateDistanceDerivatives(const std::vector<int > &changed);
     int getIndex(const Eigen::VectorXd &x) const;
+    int getIndex(const double *x) const;
+    // getIndex(const double*) for dim_ == Dim
+    template <int Dim >
+    int getIndexFixed(const double *x) const;
     int getIndex(const KDL::Vector &x) const;
     int getIndexDim(double x, int dim_idx) const;
+    // getIndex(const KDL::Vector&) and the 3-D index helpers address the distance map in its layout
+    void updateLayout();
+    void copyDistanceMap(std::vector<double > &values) const;
+    void copyVoxelBytes(const VoxelStorage<unsigned char > &storage, std::vector<unsigned char > &values) const;
+    void setVoxelBytes(const std::vector<unsigned char > &values, unsigned char background, VoxelStorage<unsigned char > &storage);
     int composeIndex(const Eigen::Vector3i &i) const;
     int composeIndex(int ix, int iy, int iz) const;
     void decomposeIndex(int idx, int &ix, int &iy, int &iz) const;
@@ -104,19 +369,143 @@ protected:
 
     double voxel_size_;
     int dim_;
+    bool sparse_;
     int max_value_;
     Eigen::VectorXd ep_min_, ep_max_;
     std::vector<std::vector<int > > neighbours_;
-    std::vector<int > r_map_;
-    std::vector<int > p_map_;
+    CounterStorage r_map_;
+    CounterStorage p_map_;
     std::vector<int > steps_;
-    std::vector<std::list<std::pair<KDL::Rotation, Eigen::VectorXd > > > r_map_rot_;
-
-    std::vector<double > d_map_;
-    std::vector<Derivatives > dd_map_;
-    std::set<int > bounduary_set_;
+    VoxelStorage<boost::uint64_t > r_map_rot_;
+    int rot_resolution_;
+    int rot_words_;
+    GenerationStats generation_stats_;
+
+    DistanceStorage d_map_;
+    DistanceStorage::Encoding distance_encoding_;
+    double distance_resolution_;
+    DistanceMapLayout layout_;
+    int brick_bits_;
+    int layout_bits_;
+    std::vector<int > layout_steps_;
+    // per-axis offsets of the brick layout; the row-major layout (layout_bits_ == 0) is computed
+    std::vector<int > layout_offsets_[3];
+    // descent direction of every voxel for the gradient field, coded as parents_
+    VoxelStorage<unsigned char > descent_;
+    VoxelStorage<unsigned char > flags_;
+    VoxelStorage<unsigned char > parents_;
+    // occupancy grid of the distance map for updateObstacles, in the row-major order
+    std::vector<boost::uint64_t > occupancy_;
+    DistanceMapParams distance_params_;
     KDL::Vector origin_;
+    CoefficientCacheType coeff_cache_type_;
+    int coeff_cache_capacity_;
+    boost::shared_ptr<CoefficientCache > coeff_cache_;
+
+    boost::shared_ptr<boost::interprocess::mapped_region > mapped_region_;
+};
+
+inline int ReachabilityMap::composeIndex(int ix, int iy, int iz) const {
+    if (layout_bits_ == 0) {
+        return (ix * steps_[1] + iy) * steps_[2] + iz;
+    }
+    return layout_offsets_[0][ix] + layout_offsets_[1][iy] + layout_offsets_[2][iz];
+}
+
+// the bounds are checked for all dimensions at once, without a branch per dimension
+template <int Dim >
+inline int ReachabilityMap::getIndexFixed(const double *x) const {
+    const double *ep_min = ep_min_.data();
+    const int *steps = &steps_[0];
+    // unsigned, so the index of a point outside the map may wrap around
+    unsigned int total_idx = 0;
+    bool inside = true;
+    for (int dim_idx = 0; dim_idx < Dim; dim_idx++) {
+        int idx = static_cast<int >( std::floor( (x[dim_idx] - ep_min[dim_idx]) / voxel_size_ ) );
+        inside &= (idx >= 0) & (idx < steps[dim_idx]);
+        total_idx = total_idx * steps[dim_idx] + idx;
+    }
+    return inside ? static_cast<int >(total_idx) : -1;
+}
+
+template <int Dim >
+inline double ReachabilityMap::getValue(const Eigen::Matrix<double, Dim, 1 > &x) const {
+    if (dim_ != Dim || r_map_.empty()) {
+        return 0;
+    }
+    int idx = getIndexFixed<Dim >(x.data());
+    if (idx < 0) {
+        return 0;
+    }
+    int penalty = (p_map_.empty() ? 0 : p_map_[idx]);
+    return static_cast<double >(r_map_[idx] - penalty) / static_cast<double >(max_value_);
+}
+
+class ReachabilityMap::InterpolationNearest {
+public:
+    static double evaluate(const ReachabilityMap &map, int ix, int iy, int iz, double u, double v, double w) {
+        if (u >= 0.5) ix++;
+        if (v >= 0.5) iy++;
+        if (w >= 0.5) iz++;
+        return map.d_map_[map.composeIndex(ix, iy, iz)];
+    }
 };
+
+class ReachabilityMap::InterpolationTrilinear {
+public:
+    static double evaluate(const ReachabilityMap &map, int ix, int iy, int iz, double u, double v, double w) {
+        int x0, x1, y0, y1, z0, z1;
+        if (map.layout_bits_ == 0) {
+            const int stride_y = map.steps_[2], stride_x = map.steps_[1] * stride_y;
+            x0 = ix * stride_x; x1 = x0 + stride_x;
+            y0 = iy * stride_y; y1 = y0 + stride_y;
+            z0 = iz; z1 = iz + 1;
+        }
+        else {
+            x0 = map.layout_offsets_[0][ix]; x1 = map.layout_offsets_[0][ix + 1];
+            y0 = map.layout_offsets_[1][iy]; y1 = map.layout_offsets_[1][iy + 1];
+            z0 = map.layout_offsets_[2][iz]; z1 = map.layout_offsets_[2][iz + 1];
+        }
+        const int indices[8] = {x0 + y0 + z0, x1 + y0 + z0, x0 + y1 + z0, x1 + y1 + z0, x0 + y0 + z1, x1 + y0 + z1, x0 + y1 + z1, x1 + y1 + z1};
+        double d[8];
+        map.d_map_.gather(indices, 8, d);
+        double c00 = d[0] + (d[1] - d[0]) * u;
+        double c10 = d[2] + (d[3] - d[2]) * u;
+        double c01 = d[4] + (d[5] - d[4]) * u;
+        double c11 = d[6] + (d[7] - d[6]) * u;
+        double c0 = c00 + (c10 - c00) * v;
+        double c1 = c01 + (c11 - c01) * v;
+        return c0 + (c1 - c0) * w;
+    }
+};
+
+class ReachabilityMap::InterpolationTricubic {
+public:
+    static double evaluate(const ReachabilityMap &map, int ix, int iy, int iz, double u, double v, double w) {
+        return map.getTricubicDistance(ix, iy, iz, u, v, w);
+    }
+};
+
+template <typename Interpolation >
+inline bool ReachabilityMap::getDistance(const KDL::Vector &x, double &distance) const {
+    if (d_map_.empty()) {
+        return false;
+    }
+
+    double cx = (x.x() - ep_min_(0)) / voxel_size_;
+    double cy = (x.y() - ep_min_(1)) / voxel_size_;
+    double cz = (x.z() - ep_min_(2)) / voxel_size_;
+    int ix0 = std::floor(cx);
+    int iy0 = std::floor(cy);
+    int iz0 = std::floor(cz);
+
+    if (ix0 < 1 || iy0 < 1 || iz0 < 1 || ix0 >= steps_[0]-3 || iy0 >= steps_[1]-3 || iz0 >= steps_[2]-3) {
+        return false;
+    }
+
+    distance = Interpolation::evaluate(*this, ix0, iy0, iz0, cx - ix0, cy - iy0, cz - iz0) / voxel_size_;
+    return true;
+}
 /*
 class VoxelGrid3 {
 public:
@@ -0,0 +1,321 @@
+// Copyright (c) 2015, Robot Control and Pattern Recognition Group,
+// Institute of Control and Computation Engineering
+// Warsaw University of Technology
+//
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Warsaw University of Technology nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYright HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Author: Dawid Seredynski
+//
+
+
+#ifndef VOXEL_STORAGE_H__
+#define VOXEL_STORAGE_H__
+
+#include <vector>
+#include <cstddef>
+#include <boost/unordered_map.hpp>
+#include <boost/cstdint.hpp>
+
+#include "mapped_vector.h"
+
+// Division by a fixed divisor as a multiplication and a shift (Granlund, Montgomery):
+// with shift = 31 + ceil(log2(divisor)) and multiplier = ceil(2^shift / divisor), the quotient
+// is exact for the dividends below 2^31, and the product fits in 64 bits.
+class FixedDivisor {
+public:
+    static const size_t MAX_DIVIDEND = size_t(1) << 31;
+
+    FixedDivisor() :
+        divisor_(1),
+        multiplier_(boost::uint64_t(1) << 31),
+        shift_(31)
+    {
+    }
+
+    explicit FixedDivisor(size_t divisor) :
+        divisor_(divisor)
+    {
+        int bits = 0;
+        while ((size_t(1) << bits) < divisor) {
+            bits++;
+        }
+        shift_ = 31 + bits;
+        multiplier_ = ((boost::uint64_t(1) << shift_) + divisor - 1) / divisor;
+    }
+
+    size_t divide(size_t dividend) const {
+        return static_cast<size_t >((static_cast<boost::uint64_t >(dividend) * multiplier_) >> shift_);
+    }
+
+    size_t getDivisor() const {
+        return divisor_;
+    }
+
+private:
+    size_t divisor_;
+    boost::uint64_t multiplier_;
+    int shift_;
+};
+
+// Values of a voxel grid, stride_ elements per voxel, addressed with the row-major index
+// of the element. The dense storage keeps all elements in a MappedVector. The sparse
+// storage allocates blocks of 8^dim voxels in a hash map, only when an element
+// of the block is written; the remaining elements have the background value.
+// Memory-mapped data is always dense.
+template <typename T >
+class VoxelStorage {
+public:
+    static const int BLOCK_BITS = 3;
+    static const int BLOCK_SIZE = 1 << BLOCK_BITS;
+
+    typedef T value_type;
+
+    VoxelStorage() :
+        sparse_(false),
+        use_blocks_(false),
+        stride_(1),
+        size_(0),
+        block_elements_(0),
+        background_()
+    {
+    }
+
+    void setSparse(bool sparse) {
+        sparse_ = sparse;
+        reset(steps_, stride_, background_);
+    }
+
+    bool isSparse() const {
+        return use_blocks_;
+    }
+
+    // sets the grid size and fills it with value
+    void reset(const std::vector<int > &steps, int stride, const T &value) {
+        setShape(steps, stride);
+        fill(value);
+    }
+
+    void fill(const T &value) {
+        background_ = value;
+        blocks_.clear();
+        use_blocks_ = sparse_;
+        if (use_blocks_) {
+            dense_.clear();
+        }
+        else {
+            dense_.assign(size_, value);
+        }
+    }
+
+    void clear() {
+        reset(std::vector<int >(), 1, T());
+    }
+
+    // refers to the dense data of the given grid size; the elements of the sparse
+    // storage equal to background are not allocated when the data is detached
+    void map(const std::vector<int > &steps, int stride, const T *data, const T &background) {
+        setShape(steps, stride);
+        background_ = background;
+        blocks_.clear();
+        use_blocks_ = false;
+        dense_.map(data, size_);
+    }
+
+    // makes a private copy of the mapped data, sparse if the sparse storage is selected
+    void detach() {
+        if (!dense_.isMapped()) {
+            return;
+        }
+        if (!sparse_) {
+            dense_.detach();
+            return;
+        }
+        // the mapped memory is owned by someone else, so it stays valid after fill()
+        const T *data = dense_.begin();
+        fill(background_);
+        for (size_t idx = 0; idx < size_; idx++) {
+            if (data[idx] != background_) {
+                set(idx, data[idx]);
+            }
+        }
+    }
+
+    bool isMapped() const {
+        return dense_.isMapped();
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    // the dense data, or NULL for the sparse storage
+    const T *data() const {
+        return use_blocks_ ? NULL : dense_.begin();
+    }
+
+    void copyTo(std::vector<T > &v) const {
+        v.resize(size_);
+        for (size_t idx = 0; idx < size_; idx++) {
+            v[idx] = (*this)[idx];
+        }
+    }
+
+    int getBlocksCount() const {
+        return blocks_.size();
+    }
+
+    size_t getMemoryUsage() const {
+        if (!use_blocks_) {
+            return dense_.isMapped() ? 0 : dense_.size() * sizeof(T);
+        }
+        return blocks_.size() * (block_elements_ * sizeof(T) + sizeof(typename BlockMap::value_type)) + blocks_.bucket_count() * sizeof(void*);
+    }
+
+    const T &operator[](size_t idx) const {
+        if (!use_blocks_) {
+            return dense_[idx];
+        }
+        size_t key, offset;
+        locate(idx, key, offset);
+        typename BlockMap::const_iterator it = blocks_.find(key);
+        if (it == blocks_.end()) {
+            return background_;
+        }
+        return it->second[offset];
+    }
+
+    // reads the element without allocating anything
+    const T &get(size_t idx) const {
+        return (*this)[idx];
+    }
+
+    // writes the element; the only access that allocates the block of the element
+    // for the sparse storage, so reading the grid never makes it dense
+    void set(size_t idx, const T &value) {
+        if (!use_blocks_) {
+            dense_[idx] = value;
+            return;
+        }
+        size_t key, offset;
+        locate(idx, key, offset);
+        typename BlockMap::iterator it = blocks_.find(key);
+        if (it == blocks_.end()) {
+            it = blocks_.insert( std::make_pair(key, std::vector<T >(block_elements_, background_)) ).first;
+        }
+        it->second[offset] = value;
+    }
+
+    // reads the elements of count indices into values, with the storage checked once
+    template <typename U >
+    void gather(const int *indices, int count, U *values) const {
+        if (!use_blocks_) {
+            const T *data = dense_.begin();
+            for (int i = 0; i < count; i++) {
+                values[i] = data[indices[i]];
+            }
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            values[i] = get(indices[i]);
+        }
+    }
+
+protected:
+    typedef boost::unordered_map<size_t, std::vector<T > > BlockMap;
+
+    void setShape(const std::vector<int > &steps, int stride) {
+        steps_ = steps;
+        stride_ = stride;
+        size_ = (steps_.empty() ? 0 : stride_);
+        block_mult_.resize(steps_.size());
+        local_mult_.resize(steps_.size());
+        step_divisors_.resize(steps_.size());
+        stride_divisor_ = FixedDivisor(stride_);
+        int block_mult = 1, local_mult = 1;
+        for (int dim_idx = steps_.size() - 1; dim_idx >= 0; dim_idx--) {
+            size_ *= steps_[dim_idx];
+            step_divisors_[dim_idx] = FixedDivisor(steps_[dim_idx]);
+            block_mult_[dim_idx] = block_mult;
+            local_mult_[dim_idx] = local_mult;
+            block_mult *= (steps_[dim_idx] + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            local_mult *= BLOCK_SIZE;
+        }
+        block_elements_ = local_mult * stride_;
+    }
+
+    // the divisions by the steps are multiplications, unless the grid is too large for them
+    void locate(size_t idx, size_t &key, size_t &offset) const {
+        if (size_ > FixedDivisor::MAX_DIVIDEND) {
+            locateLarge(idx, key, offset);
+            return;
+        }
+        // summed in locals, as key and offset could alias the members
+        size_t voxel = stride_divisor_.divide(idx);
+        size_t element = idx - voxel * stride_;
+        size_t block_key = 0, local_offset = 0;
+        for (int dim_idx = steps_.size() - 1; dim_idx >= 0; dim_idx--) {
+            size_t rest = step_divisors_[dim_idx].divide(voxel);
+            size_t i = voxel - rest * steps_[dim_idx];
+            voxel = rest;
+            block_key += (i >> BLOCK_BITS) * block_mult_[dim_idx];
+            local_offset += (i & (BLOCK_SIZE - 1)) * local_mult_[dim_idx];
+        }
+        key = block_key;
+        offset = local_offset * stride_ + element;
+    }
+
+    void locateLarge(size_t idx, size_t &key, size_t &offset) const {
+        size_t voxel = idx / stride_;
+        key = 0;
+        offset = 0;
+        for (int dim_idx = steps_.size() - 1; dim_idx >= 0; dim_idx--) {
+            size_t i = voxel % steps_[dim_idx];
+            voxel /= steps_[dim_idx];
+            key += (i >> BLOCK_BITS) * block_mult_[dim_idx];
+            offset += (i & (BLOCK_SIZE - 1)) * local_mult_[dim_idx];
+        }
+        offset = offset * stride_ + idx % stride_;
+    }
+
+    bool sparse_;
+    bool use_blocks_;
+    std::vector<int > steps_;
+    std::vector<size_t > block_mult_;
+    std::vector<size_t > local_mult_;
+    std::vector<FixedDivisor > step_divisors_;
+    FixedDivisor stride_divisor_;
+    int stride_;
+    size_t size_;
+    int block_elements_;
+    T background_;
+    MappedVector<T > dense_;
+    BlockMap blocks_;
+};
+
+#endif  // VOXEL_STORAGE_H__
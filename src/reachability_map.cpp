@@ -32,6 +32,17 @@
 #include <kdl/frames.hpp>
 #include "Eigen/Dense"
 
+#include <fstream>
+#include <cstring>
+#include <boost/thread.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/seed_seq.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <boost/unordered_set.hpp>
+
 #include "planer_utils/reachability_map.h"
 #include "planer_utils/random_uniform.h"
 
@@ -176,77 +187,168 @@ double tricubic_eval(double a[64], double x, double y, double z, int derx, int d
   return(ret);
 }
 
+/* TRICUBIC_EVAL_DERIVATIVES
+   evaluates f, its gradient df = (fx, fy, fz) and optionally its Hessian
+   ddf = (fxx, fyy, fzz, fxy, fxz, fyz) in one pass over the coefficients;
+   f and ddf may be NULL
+*/
+void tricubic_eval_derivatives(const double a[64], double x, double y, double z, double *f, double df[3], double ddf[6]) {
+  double px[4] = {1.0, x, x*x, x*x*x}, dpx[4] = {0.0, 1.0, 2.0*x, 3.0*x*x}, ddpx[4] = {0.0, 0.0, 2.0, 6.0*x};
+  double py[4] = {1.0, y, y*y, y*y*y}, dpy[4] = {0.0, 1.0, 2.0*y, 3.0*y*y}, ddpy[4] = {0.0, 0.0, 2.0, 6.0*y};
+  double pz[4] = {1.0, z, z*z, z*z*z}, dpz[4] = {0.0, 1.0, 2.0*z, 3.0*z*z}, ddpz[4] = {0.0, 0.0, 2.0, 6.0*z};
+  double ret = 0.0, ret_d[3] = {0.0, 0.0, 0.0}, ret_dd[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+  int i,j,k;
+  for (k=0;k<4;k++) {
+    for (j=0;j<4;j++) {
+      for (i=0;i<4;i++) {
+        double c = a[ijk2n(i,j,k)];
+        ret += c*px[i]*py[j]*pz[k];
+        ret_d[0] += c*dpx[i]*py[j]*pz[k];
+        ret_d[1] += c*px[i]*dpy[j]*pz[k];
+        ret_d[2] += c*px[i]*py[j]*dpz[k];
+        if (ddf != NULL) {
+          ret_dd[0] += c*ddpx[i]*py[j]*pz[k];
+          ret_dd[1] += c*px[i]*ddpy[j]*pz[k];
+          ret_dd[2] += c*px[i]*py[j]*ddpz[k];
+          ret_dd[3] += c*dpx[i]*dpy[j]*pz[k];
+          ret_dd[4] += c*dpx[i]*py[j]*dpz[k];
+          ret_dd[5] += c*px[i]*dpy[j]*dpz[k];
+        }
+      }
+    }
+  }
+  if (f != NULL) {
+    *f = ret;
+  }
+  for (i=0;i<3;i++) {
+    df[i] = ret_d[i];
+  }
+  if (ddf != NULL) {
+    for (i=0;i<6;i++) {
+      ddf[i] = ret_dd[i];
+    }
+  }
+}
+
+/* TRICUBIC_EVAL_VALUE, TRICUBIC_EVAL_GRADIENT
+   evaluate f, and f with its gradient df = (fx, fy, fz), in nested Horner form:
+   first along z over the 16 (i,j) columns of the coefficients, then along y
+   over 4 columns, then along x. The columns are contiguous in a[], so the
+   loops over them are plain lanes the compiler can vectorize.
+*/
+double tricubic_eval_value(const double a[64], double x, double y, double z) {
+  double t[16], q[4];
+  int n;
+  for (n=0;n<16;n++) {
+    t[n] = ((a[48+n]*z + a[32+n])*z + a[16+n])*z + a[n];
+  }
+  for (n=0;n<4;n++) {
+    q[n] = ((t[12+n]*y + t[8+n])*y + t[4+n])*y + t[n];
+  }
+  return ((q[3]*x + q[2])*x + q[1])*x + q[0];
+}
+
+void tricubic_eval_gradient(const double a[64], double x, double y, double z, double *f, double df[3]) {
+  double t[16], tz[16], q[4], qy[4], qz[4];
+  int n;
+  for (n=0;n<16;n++) {
+    t[n] = ((a[48+n]*z + a[32+n])*z + a[16+n])*z + a[n];
+    tz[n] = (3.0*a[48+n]*z + 2.0*a[32+n])*z + a[16+n];
+  }
+  for (n=0;n<4;n++) {
+    q[n] = ((t[12+n]*y + t[8+n])*y + t[4+n])*y + t[n];
+    qy[n] = (3.0*t[12+n]*y + 2.0*t[8+n])*y + t[4+n];
+    qz[n] = ((tz[12+n]*y + tz[8+n])*y + tz[4+n])*y + tz[n];
+  }
+  if (f != NULL) {
+    *f = ((q[3]*x + q[2])*x + q[1])*x + q[0];
+  }
+  df[0] = (3.0*q[3]*x + 2.0*q[2])*x + q[1];
+  df[1] = ((qy[3]*x + qy[2])*x + qy[1])*x + qy[0];
+  df[2] = ((qz[3]*x + qz[2])*x + qz[1])*x + qz[0];
+}
+
 void ReachabilityMap::tricubic_get_coeff(double a[64], int xi, int yi, int zi) const {
-    int i;
+    // the 4x4x4 voxels around the cell, f[i][j][k] at (xi-1+i, yi-1+j, zi-1+k), read at once
+    int indices[64];
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            for (int k = 0; k < 4; k++) {
+                indices[(i * 4 + j) * 4 + k] = composeIndex(xi - 1 + i, yi - 1 + j, zi - 1 + k);
+            }
+        }
+    }
+    double f[4][4][4];
+    d_map_.gather(indices, 64, &f[0][0][0]);
 
     double x[64] = {
       // values of f(x,y,z) at each corner.
-      d_map_[composeIndex(xi,yi,zi)],d_map_[composeIndex(xi+1,yi,zi)],d_map_[composeIndex(xi,yi+1,zi)],
-      d_map_[composeIndex(xi+1,yi+1,zi)],d_map_[composeIndex(xi,yi,zi+1)],d_map_[composeIndex(xi+1,yi,zi+1)],
-      d_map_[composeIndex(xi,yi+1,zi+1)],d_map_[composeIndex(xi+1,yi+1,zi+1)],
+      f[1][1][1],f[2][1][1],f[1][2][1],
+      f[2][2][1],f[1][1][2],f[2][1][2],
+      f[1][2][2],f[2][2][2],
       // values of df/dx at each corner.
-      0.5*(d_map_[composeIndex(xi+1,yi,zi)]-d_map_[composeIndex(xi-1,yi,zi)]),
-      0.5*(d_map_[composeIndex(xi+2,yi,zi)]-d_map_[composeIndex(xi,yi,zi)]),
-      0.5*(d_map_[composeIndex(xi+1,yi+1,zi)]-d_map_[composeIndex(xi-1,yi+1,zi)]),
-      0.5*(d_map_[composeIndex(xi+2,yi+1,zi)]-d_map_[composeIndex(xi,yi+1,zi)]),
-      0.5*(d_map_[composeIndex(xi+1,yi,zi+1)]-d_map_[composeIndex(xi-1,yi,zi+1)]),
-      0.5*(d_map_[composeIndex(xi+2,yi,zi+1)]-d_map_[composeIndex(xi,yi,zi+1)]),
-      0.5*(d_map_[composeIndex(xi+1,yi+1,zi+1)]-d_map_[composeIndex(xi-1,yi+1,zi+1)]),
-      0.5*(d_map_[composeIndex(xi+2,yi+1,zi+1)]-d_map_[composeIndex(xi,yi+1,zi+1)]),
+      0.5*(f[2][1][1]-f[0][1][1]),
+      0.5*(f[3][1][1]-f[1][1][1]),
+      0.5*(f[2][2][1]-f[0][2][1]),
+      0.5*(f[3][2][1]-f[1][2][1]),
+      0.5*(f[2][1][2]-f[0][1][2]),
+      0.5*(f[3][1][2]-f[1][1][2]),
+      0.5*(f[2][2][2]-f[0][2][2]),
+      0.5*(f[3][2][2]-f[1][2][2]),
       // values of df/dy at each corner.
-      0.5*(d_map_[composeIndex(xi,yi+1,zi)]-d_map_[composeIndex(xi,yi-1,zi)]),
-      0.5*(d_map_[composeIndex(xi+1,yi+1,zi)]-d_map_[composeIndex(xi+1,yi-1,zi)]),
-      0.5*(d_map_[composeIndex(xi,yi+2,zi)]-d_map_[composeIndex(xi,yi,zi)]),
-      0.5*(d_map_[composeIndex(xi+1,yi+2,zi)]-d_map_[composeIndex(xi+1,yi,zi)]),
-      0.5*(d_map_[composeIndex(xi,yi+1,zi+1)]-d_map_[composeIndex(xi,yi-1,zi+1)]),
-      0.5*(d_map_[composeIndex(xi+1,yi+1,zi+1)]-d_map_[composeIndex(xi+1,yi-1,zi+1)]),
-      0.5*(d_map_[composeIndex(xi,yi+2,zi+1)]-d_map_[composeIndex(xi,yi,zi+1)]),
-      0.5*(d_map_[composeIndex(xi+1,yi+2,zi+1)]-d_map_[composeIndex(xi+1,yi,zi+1)]),
+      0.5*(f[1][2][1]-f[1][0][1]),
+      0.5*(f[2][2][1]-f[2][0][1]),
+      0.5*(f[1][3][1]-f[1][1][1]),
+      0.5*(f[2][3][1]-f[2][1][1]),
+      0.5*(f[1][2][2]-f[1][0][2]),
+      0.5*(f[2][2][2]-f[2][0][2]),
+      0.5*(f[1][3][2]-f[1][1][2]),
+      0.5*(f[2][3][2]-f[2][1][2]),
       // values of df/dz at each corner.
-      0.5*(d_map_[composeIndex(xi,yi,zi+1)]-d_map_[composeIndex(xi,yi,zi-1)]),
-      0.5*(d_map_[composeIndex(xi+1,yi,zi+1)]-d_map_[composeIndex(xi+1,yi,zi-1)]),
-      0.5*(d_map_[composeIndex(xi,yi+1,zi+1)]-d_map_[composeIndex(xi,yi+1,zi-1)]),
-      0.5*(d_map_[composeIndex(xi+1,yi+1,zi+1)]-d_map_[composeIndex(xi+1,yi+1,zi-1)]),
-      0.5*(d_map_[composeIndex(xi,yi,zi+2)]-d_map_[composeIndex(xi,yi,zi)]),
-      0.5*(d_map_[composeIndex(xi+1,yi,zi+2)]-d_map_[composeIndex(xi+1,yi,zi)]),
-      0.5*(d_map_[composeIndex(xi,yi+1,zi+2)]-d_map_[composeIndex(xi,yi+1,zi)]),
-      0.5*(d_map_[composeIndex(xi+1,yi+1,zi+2)]-d_map_[composeIndex(xi+1,yi+1,zi)]),
+      0.5*(f[1][1][2]-f[1][1][0]),
+      0.5*(f[2][1][2]-f[2][1][0]),
+      0.5*(f[1][2][2]-f[1][2][0]),
+      0.5*(f[2][2][2]-f[2][2][0]),
+      0.5*(f[1][1][3]-f[1][1][1]),
+      0.5*(f[2][1][3]-f[2][1][1]),
+      0.5*(f[1][2][3]-f[1][2][1]),
+      0.5*(f[2][2][3]-f[2][2][1]),
       // values of d2f/dxdy at each corner.
-      0.25*(d_map_[composeIndex(xi+1,yi+1,zi)]-d_map_[composeIndex(xi-1,yi+1,zi)]-d_map_[composeIndex(xi+1,yi-1,zi)]+d_map_[composeIndex(xi-1,yi-1,zi)]),
-      0.25*(d_map_[composeIndex(xi+2,yi+1,zi)]-d_map_[composeIndex(xi,yi+1,zi)]-d_map_[composeIndex(xi+2,yi-1,zi)]+d_map_[composeIndex(xi,yi-1,zi)]),
-      0.25*(d_map_[composeIndex(xi+1,yi+2,zi)]-d_map_[composeIndex(xi-1,yi+2,zi)]-d_map_[composeIndex(xi+1,yi,zi)]+d_map_[composeIndex(xi-1,yi,zi)]),
-      0.25*(d_map_[composeIndex(xi+2,yi+2,zi)]-d_map_[composeIndex(xi,yi+2,zi)]-d_map_[composeIndex(xi+2,yi,zi)]+d_map_[composeIndex(xi,yi,zi)]),
-      0.25*(d_map_[composeIndex(xi+1,yi+1,zi+1)]-d_map_[composeIndex(xi-1,yi+1,zi+1)]-d_map_[composeIndex(xi+1,yi-1,zi+1)]+d_map_[composeIndex(xi-1,yi-1,zi+1)]),
-      0.25*(d_map_[composeIndex(xi+2,yi+1,zi+1)]-d_map_[composeIndex(xi,yi+1,zi+1)]-d_map_[composeIndex(xi+2,yi-1,zi+1)]+d_map_[composeIndex(xi,yi-1,zi+1)]),
-      0.25*(d_map_[composeIndex(xi+1,yi+2,zi+1)]-d_map_[composeIndex(xi-1,yi+2,zi+1)]-d_map_[composeIndex(xi+1,yi,zi+1)]+d_map_[composeIndex(xi-1,yi,zi+1)]),
-      0.25*(d_map_[composeIndex(xi+2,yi+2,zi+1)]-d_map_[composeIndex(xi,yi+2,zi+1)]-d_map_[composeIndex(xi+2,yi,zi+1)]+d_map_[composeIndex(xi,yi,zi+1)]),
+      0.25*(f[2][2][1]-f[0][2][1]-f[2][0][1]+f[0][0][1]),
+      0.25*(f[3][2][1]-f[1][2][1]-f[3][0][1]+f[1][0][1]),
+      0.25*(f[2][3][1]-f[0][3][1]-f[2][1][1]+f[0][1][1]),
+      0.25*(f[3][3][1]-f[1][3][1]-f[3][1][1]+f[1][1][1]),
+      0.25*(f[2][2][2]-f[0][2][2]-f[2][0][2]+f[0][0][2]),
+      0.25*(f[3][2][2]-f[1][2][2]-f[3][0][2]+f[1][0][2]),
+      0.25*(f[2][3][2]-f[0][3][2]-f[2][1][2]+f[0][1][2]),
+      0.25*(f[3][3][2]-f[1][3][2]-f[3][1][2]+f[1][1][2]),
       // values of d2f/dxdz at each corner.
-      0.25*(d_map_[composeIndex(xi+1,yi,zi+1)]-d_map_[composeIndex(xi-1,yi,zi+1)]-d_map_[composeIndex(xi+1,yi,zi-1)]+d_map_[composeIndex(xi-1,yi,zi-1)]),
-      0.25*(d_map_[composeIndex(xi+2,yi,zi+1)]-d_map_[composeIndex(xi,yi,zi+1)]-d_map_[composeIndex(xi+2,yi,zi-1)]+d_map_[composeIndex(xi,yi,zi-1)]),
-      0.25*(d_map_[composeIndex(xi+1,yi+1,zi+1)]-d_map_[composeIndex(xi-1,yi+1,zi+1)]-d_map_[composeIndex(xi+1,yi+1,zi-1)]+d_map_[composeIndex(xi-1,yi+1,zi-1)]),
-      0.25*(d_map_[composeIndex(xi+2,yi+1,zi+1)]-d_map_[composeIndex(xi,yi+1,zi+1)]-d_map_[composeIndex(xi+2,yi+1,zi-1)]+d_map_[composeIndex(xi,yi+1,zi-1)]),
-      0.25*(d_map_[composeIndex(xi+1,yi,zi+2)]-d_map_[composeIndex(xi-1,yi,zi+2)]-d_map_[composeIndex(xi+1,yi,zi)]+d_map_[composeIndex(xi-1,yi,zi)]),
-      0.25*(d_map_[composeIndex(xi+2,yi,zi+2)]-d_map_[composeIndex(xi,yi,zi+2)]-d_map_[composeIndex(xi+2,yi,zi)]+d_map_[composeIndex(xi,yi,zi)]),
-      0.25*(d_map_[composeIndex(xi+1,yi+1,zi+2)]-d_map_[composeIndex(xi-1,yi+1,zi+2)]-d_map_[composeIndex(xi+1,yi+1,zi)]+d_map_[composeIndex(xi-1,yi+1,zi)]),
-      0.25*(d_map_[composeIndex(xi+2,yi+1,zi+2)]-d_map_[composeIndex(xi,yi+1,zi+2)]-d_map_[composeIndex(xi+2,yi+1,zi)]+d_map_[composeIndex(xi,yi+1,zi)]),
+      0.25*(f[2][1][2]-f[0][1][2]-f[2][1][0]+f[0][1][0]),
+      0.25*(f[3][1][2]-f[1][1][2]-f[3][1][0]+f[1][1][0]),
+      0.25*(f[2][2][2]-f[0][2][2]-f[2][2][0]+f[0][2][0]),
+      0.25*(f[3][2][2]-f[1][2][2]-f[3][2][0]+f[1][2][0]),
+      0.25*(f[2][1][3]-f[0][1][3]-f[2][1][1]+f[0][1][1]),
+      0.25*(f[3][1][3]-f[1][1][3]-f[3][1][1]+f[1][1][1]),
+      0.25*(f[2][2][3]-f[0][2][3]-f[2][2][1]+f[0][2][1]),
+      0.25*(f[3][2][3]-f[1][2][3]-f[3][2][1]+f[1][2][1]),
       // values of d2f/dydz at each corner.
-      0.25*(d_map_[composeIndex(xi,yi+1,zi+1)]-d_map_[composeIndex(xi,yi-1,zi+1)]-d_map_[composeIndex(xi,yi+1,zi-1)]+d_map_[composeIndex(xi,yi-1,zi-1)]),
-      0.25*(d_map_[composeIndex(xi+1,yi+1,zi+1)]-d_map_[composeIndex(xi+1,yi-1,zi+1)]-d_map_[composeIndex(xi+1,yi+1,zi-1)]+d_map_[composeIndex(xi+1,yi-1,zi-1)]),
-      0.25*(d_map_[composeIndex(xi,yi+2,zi+1)]-d_map_[composeIndex(xi,yi,zi+1)]-d_map_[composeIndex(xi,yi+2,zi-1)]+d_map_[composeIndex(xi,yi,zi-1)]),
-      0.25*(d_map_[composeIndex(xi+1,yi+2,zi+1)]-d_map_[composeIndex(xi+1,yi,zi+1)]-d_map_[composeIndex(xi+1,yi+2,zi-1)]+d_map_[composeIndex(xi+1,yi,zi-1)]),
-      0.25*(d_map_[composeIndex(xi,yi+1,zi+2)]-d_map_[composeIndex(xi,yi-1,zi+2)]-d_map_[composeIndex(xi,yi+1,zi)]+d_map_[composeIndex(xi,yi-1,zi)]),
-      0.25*(d_map_[composeIndex(xi+1,yi+1,zi+2)]-d_map_[composeIndex(xi+1,yi-1,zi+2)]-d_map_[composeIndex(xi+1,yi+1,zi)]+d_map_[composeIndex(xi+1,yi-1,zi)]),
-      0.25*(d_map_[composeIndex(xi,yi+2,zi+2)]-d_map_[composeIndex(xi,yi,zi+2)]-d_map_[composeIndex(xi,yi+2,zi)]+d_map_[composeIndex(xi,yi,zi)]),
-      0.25*(d_map_[composeIndex(xi+1,yi+2,zi+2)]-d_map_[composeIndex(xi+1,yi,zi+2)]-d_map_[composeIndex(xi+1,yi+2,zi)]+d_map_[composeIndex(xi+1,yi,zi)]),
+      0.25*(f[1][2][2]-f[1][0][2]-f[1][2][0]+f[1][0][0]),
+      0.25*(f[2][2][2]-f[2][0][2]-f[2][2][0]+f[2][0][0]),
+      0.25*(f[1][3][2]-f[1][1][2]-f[1][3][0]+f[1][1][0]),
+      0.25*(f[2][3][2]-f[2][1][2]-f[2][3][0]+f[2][1][0]),
+      0.25*(f[1][2][3]-f[1][0][3]-f[1][2][1]+f[1][0][1]),
+      0.25*(f[2][2][3]-f[2][0][3]-f[2][2][1]+f[2][0][1]),
+      0.25*(f[1][3][3]-f[1][1][3]-f[1][3][1]+f[1][1][1]),
+      0.25*(f[2][3][3]-f[2][1][3]-f[2][3][1]+f[2][1][1]),
       // values of d3f/dxdydz at each corner.
-      0.125*(d_map_[composeIndex(xi+1,yi+1,zi+1)]-d_map_[composeIndex(xi-1,yi+1,zi+1)]-d_map_[composeIndex(xi+1,yi-1,zi+1)]+d_map_[composeIndex(xi-1,yi-1,zi+1)]-d_map_[composeIndex(xi+1,yi+1,zi-1)]+d_map_[composeIndex(xi-1,yi+1,zi-1)]+d_map_[composeIndex(xi+1,yi-1,zi-1)]-d_map_[composeIndex(xi-1,yi-1,zi-1)]),
-      0.125*(d_map_[composeIndex(xi+2,yi+1,zi+1)]-d_map_[composeIndex(xi,yi+1,zi+1)]-d_map_[composeIndex(xi+2,yi-1,zi+1)]+d_map_[composeIndex(xi,yi-1,zi+1)]-d_map_[composeIndex(xi+2,yi+1,zi-1)]+d_map_[composeIndex(xi,yi+1,zi-1)]+d_map_[composeIndex(xi+2,yi-1,zi-1)]-d_map_[composeIndex(xi,yi-1,zi-1)]),
-      0.125*(d_map_[composeIndex(xi+1,yi+2,zi+1)]-d_map_[composeIndex(xi-1,yi+2,zi+1)]-d_map_[composeIndex(xi+1,yi,zi+1)]+d_map_[composeIndex(xi-1,yi,zi+1)]-d_map_[composeIndex(xi+1,yi+2,zi-1)]+d_map_[composeIndex(xi-1,yi+2,zi-1)]+d_map_[composeIndex(xi+1,yi,zi-1)]-d_map_[composeIndex(xi-1,yi,zi-1)]),
-      0.125*(d_map_[composeIndex(xi+2,yi+2,zi+1)]-d_map_[composeIndex(xi,yi+2,zi+1)]-d_map_[composeIndex(xi+2,yi,zi+1)]+d_map_[composeIndex(xi,yi,zi+1)]-d_map_[composeIndex(xi+2,yi+2,zi-1)]+d_map_[composeIndex(xi,yi+2,zi-1)]+d_map_[composeIndex(xi+2,yi,zi-1)]-d_map_[composeIndex(xi,yi,zi-1)]),
-      0.125*(d_map_[composeIndex(xi+1,yi+1,zi+2)]-d_map_[composeIndex(xi-1,yi+1,zi+2)]-d_map_[composeIndex(xi+1,yi-1,zi+2)]+d_map_[composeIndex(xi-1,yi-1,zi+2)]-d_map_[composeIndex(xi+1,yi+1,zi)]+d_map_[composeIndex(xi-1,yi+1,zi)]+d_map_[composeIndex(xi+1,yi-1,zi)]-d_map_[composeIndex(xi-1,yi-1,zi)]),
-      0.125*(d_map_[composeIndex(xi+2,yi+1,zi+2)]-d_map_[composeIndex(xi,yi+1,zi+2)]-d_map_[composeIndex(xi+2,yi-1,zi+2)]+d_map_[composeIndex(xi,yi-1,zi+2)]-d_map_[composeIndex(xi+2,yi+1,zi)]+d_map_[composeIndex(xi,yi+1,zi)]+d_map_[composeIndex(xi+2,yi-1,zi)]-d_map_[composeIndex(xi,yi-1,zi)]),
-      0.125*(d_map_[composeIndex(xi+1,yi+2,zi+2)]-d_map_[composeIndex(xi-1,yi+2,zi+2)]-d_map_[composeIndex(xi+1,yi,zi+2)]+d_map_[composeIndex(xi-1,yi,zi+2)]-d_map_[composeIndex(xi+1,yi+2,zi)]+d_map_[composeIndex(xi-1,yi+2,zi)]+d_map_[composeIndex(xi+1,yi,zi)]-d_map_[composeIndex(xi-1,yi,zi)]),
-      0.125*(d_map_[composeIndex(xi+2,yi+2,zi+2)]-d_map_[composeIndex(xi,yi+2,zi+2)]-d_map_[composeIndex(xi+2,yi,zi+2)]+d_map_[composeIndex(xi,yi,zi+2)]-d_map_[composeIndex(xi+2,yi+2,zi)]+d_map_[composeIndex(xi,yi+2,zi)]+d_map_[composeIndex(xi+2,yi,zi)]-d_map_[composeIndex(xi,yi,zi)])
+      0.125*(f[2][2][2]-f[0][2][2]-f[2][0][2]+f[0][0][2]-f[2][2][0]+f[0][2][0]+f[2][0][0]-f[0][0][0]),
+      0.125*(f[3][2][2]-f[1][2][2]-f[3][0][2]+f[1][0][2]-f[3][2][0]+f[1][2][0]+f[3][0][0]-f[1][0][0]),
+      0.125*(f[2][3][2]-f[0][3][2]-f[2][1][2]+f[0][1][2]-f[2][3][0]+f[0][3][0]+f[2][1][0]-f[0][1][0]),
+      0.125*(f[3][3][2]-f[1][3][2]-f[3][1][2]+f[1][1][2]-f[3][3][0]+f[1][3][0]+f[3][1][0]-f[1][1][0]),
+      0.125*(f[2][2][3]-f[0][2][3]-f[2][0][3]+f[0][0][3]-f[2][2][1]+f[0][2][1]+f[2][0][1]-f[0][0][1]),
+      0.125*(f[3][2][3]-f[1][2][3]-f[3][0][3]+f[1][0][3]-f[3][2][1]+f[1][2][1]+f[3][0][1]-f[1][0][1]),
+      0.125*(f[2][3][3]-f[0][3][3]-f[2][1][3]+f[0][1][3]-f[2][3][1]+f[0][3][1]+f[2][1][1]-f[0][1][1]),
+      0.125*(f[3][3][3]-f[1][3][3]-f[3][1][3]+f[1][1][3]-f[3][3][1]+f[1][3][1]+f[3][1][1]-f[1][1][1])
     };
     tricubic_get_coeff_stacked(a,x);
 }
@@ -367,12 +469,154 @@ fptype ReachabilityMap::ip(list xyz){
   return result;
 }
 */
-    ReachabilityMap::ReachabilityMap(double voxel_size, int dim) :
+    // the lazy cache is split by the cell index into shards with their own locks and LRU lists,
+    // so the threads that query the map rarely wait for each other
+    static const int COEFF_CACHE_SHARDS = 64;
+
+    // tricubic coefficients of the distance map cells, 64 per cell
+    class ReachabilityMap::CoefficientCache {
+    public:
+        // capacity is the number of cells of the lazy cache, 0 means no limit;
+        // it is divided between the shards
+        CoefficientCache(int capacity)
+        {
+            for (int i = 0; i < COEFF_CACHE_SHARDS; i++) {
+                shards_[i].capacity_ = (capacity > 0 ? std::max(1, (capacity + COEFF_CACHE_SHARDS - 1) / COEFF_CACHE_SHARDS) : 0);
+            }
+        }
+
+        // the precomputed coefficients are read-only, so no locking is needed
+        std::vector<double > precomputed_;
+
+        bool get(int cell, double a[64]) {
+            Shard &shard = shards_[cell % COEFF_CACHE_SHARDS];
+            boost::mutex::scoped_lock lock(shard.mutex_);
+            boost::unordered_map<int, Entry >::iterator it = shard.entries_.find(cell);
+            if (it == shard.entries_.end()) {
+                return false;
+            }
+            // move the cell to the front of the LRU list
+            shard.lru_.splice(shard.lru_.begin(), shard.lru_, it->second.lru_it_);
+            memcpy(a, &shard.coeffs_[it->second.slot_ * 64], 64 * sizeof(double));
+            return true;
+        }
+
+        void put(int cell, const double a[64]) {
+            Shard &shard = shards_[cell % COEFF_CACHE_SHARDS];
+            boost::mutex::scoped_lock lock(shard.mutex_);
+            if (shard.entries_.find(cell) != shard.entries_.end()) {
+                return;
+            }
+            size_t slot;
+            if (shard.capacity_ > 0 && shard.entries_.size() >= static_cast<size_t >(shard.capacity_)) {
+                // reuse the slot of the least recently used cell
+                boost::unordered_map<int, Entry >::iterator it = shard.entries_.find(shard.lru_.back());
+                slot = it->second.slot_;
+                shard.entries_.erase(it);
+                shard.lru_.pop_back();
+            }
+            else {
+                slot = shard.entries_.size();
+                shard.coeffs_.resize((slot + 1) * 64);
+            }
+            shard.lru_.push_front(cell);
+            Entry entry = {shard.lru_.begin(), slot};
+            shard.entries_.insert( std::make_pair(cell, entry) );
+            memcpy(&shard.coeffs_[slot * 64], a, 64 * sizeof(double));
+        }
+
+    private:
+        struct Entry {
+            std::list<int >::iterator lru_it_;
+            size_t slot_;
+        };
+
+        struct Shard {
+            boost::mutex mutex_;
+            int capacity_;
+            std::list<int > lru_;
+            boost::unordered_map<int, Entry > entries_;
+            std::vector<double > coeffs_;
+        };
+
+        Shard shards_[COEFF_CACHE_SHARDS];
+    };
+
+    void ReachabilityMap::setCoefficientCache(CoefficientCacheType type, int capacity) {
+        coeff_cache_type_ = type;
+        coeff_cache_capacity_ = capacity;
+        resetCoefficientCache();
+    }
+
+    void ReachabilityMap::resetCoefficientCache() {
+        coeff_cache_.reset();
+        if (coeff_cache_type_ == COEFF_CACHE_NONE || d_map_.empty() || steps_.size() != 3) {
+            return;
+        }
+
+        coeff_cache_.reset( new CoefficientCache(coeff_cache_capacity_) );
+        if (coeff_cache_type_ == COEFF_CACHE_PRECOMPUTED) {
+            // only the cells that can be queried
+            coeff_cache_->precomputed_.resize(d_map_.size() * 64, 0.0);
+            for (int ix = 1; ix < steps_[0] - 3; ix++) {
+                for (int iy = 1; iy < steps_[1] - 3; iy++) {
+                    for (int iz = 1; iz < steps_[2] - 3; iz++) {
+                        tricubic_get_coeff(&coeff_cache_->precomputed_[static_cast<size_t >(composeIndex(ix, iy, iz)) * 64], ix, iy, iz);
+                    }
+                }
+            }
+        }
+    }
+
+    const double *ReachabilityMap::getPrecomputedCoefficients(int ix, int iy, int iz) const {
+        if (!coeff_cache_ || coeff_cache_type_ != COEFF_CACHE_PRECOMPUTED) {
+            return NULL;
+        }
+        return &coeff_cache_->precomputed_[static_cast<size_t >(composeIndex(ix, iy, iz)) * 64];
+    }
+
+    void ReachabilityMap::getCoefficients(double a[64], int ix, int iy, int iz) const {
+        if (!coeff_cache_) {
+            tricubic_get_coeff(a, ix, iy, iz);
+            return;
+        }
+
+        int cell = composeIndex(ix, iy, iz);
+        if (coeff_cache_type_ == COEFF_CACHE_PRECOMPUTED) {
+            memcpy(a, &coeff_cache_->precomputed_[static_cast<size_t >(cell) * 64], 64 * sizeof(double));
+            return;
+        }
+
+        if (!coeff_cache_->get(cell, a)) {
+            tricubic_get_coeff(a, ix, iy, iz);
+            coeff_cache_->put(cell, a);
+        }
+    }
+
+    ReachabilityMap::ReachabilityMap(double voxel_size, int dim, bool sparse) :
         voxel_size_(voxel_size),
         dim_(dim),
+        sparse_(sparse),
         ep_min_(dim),
-        ep_max_(dim)
+        ep_max_(dim),
+        rot_resolution_(0),
+        rot_words_(0),
+        distance_encoding_(DistanceStorage::ENCODING_FLOAT64),
+        distance_resolution_(0.0),
+        layout_(LAYOUT_ROW_MAJOR),
+        brick_bits_(0),
+        layout_bits_(0),
+        coeff_cache_type_(COEFF_CACHE_NONE),
+        coeff_cache_capacity_(0)
     {
+        r_map_.setSparse(sparse);
+        p_map_.setSparse(sparse);
+        r_map_rot_.setSparse(sparse);
+        d_map_.setSparse(sparse);
+        descent_.setSparse(sparse);
+        flags_.setSparse(sparse);
+        parents_.setSparse(sparse);
+
         if (dim_ == 2) {
             for (int y = -1; y <= 1; y++ ) {
                 for (int x = -1; x <= 1; x++ ) {
@@ -410,621 +654,1677 @@ fptype ReachabilityMap::ip(list xyz){
     ReachabilityMap::~ReachabilityMap() {
     }
 
-    void ReachabilityMap::generate(const boost::shared_ptr<KinematicModel> &kin_model, const boost::shared_ptr<self_collision::CollisionModel> &col_model, const std::string &effector_name, int ndof, const Eigen::VectorXd &lower_limit, const Eigen::VectorXd &upper_limit) {
-        std::list<Eigen::VectorXd > ep_B_list;
-        for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
-            ep_min_(dim_idx) = 1000000.0;
-            ep_max_(dim_idx) = -1000000.0;
-        }
+    ReachabilityMap::GenerationParams::GenerationParams() :
+        samples_count_(100000),
+        threads_count_(1),
+        seed_(0),
+        streaming_(false),
+        batch_size_(0),
+        tolerance_(0.01),
+        time_budget_(0.0),
+        sampler_(SAMPLER_UNIFORM),
+        scrambled_(false),
+        orientation_resolution_(0)
+    {
+    }
 
-        std::set<int> excluded_link_idx;
-        excluded_link_idx.insert(col_model->getLinkIndex("env_link"));
+    ReachabilityMap::DistanceMapParams::DistanceMapParams() :
+        method_(METHOD_BFS),
+        threads_count_(1),
+        gradient_field_(false),
+        precompute_occupancy_(false)
+    {
+    }
 
-        int effector_idx = col_model->getLinkIndex(effector_name);
-        std::vector<KDL::Frame > links_fk(col_model->getLinksCount());
+    ReachabilityMap::GenerationStats::GenerationStats() :
+        samples_count_(0),
+        valid_samples_count_(0),
+        batches_count_(0),
+        occupied_voxels_count_(0),
+        new_voxels_fraction_(1.0),
+        l1_change_(2.0),
+        converged_(false),
+        time_(0.0)
+    {
+    }
 
-        for (int i = 0; i < 100000; i++) {
-            Eigen::VectorXd tmp_q(ndof);
-            for (int q_idx = 0; q_idx < ndof; q_idx++) {
-                tmp_q(q_idx) = randomUniform(lower_limit(q_idx), upper_limit(q_idx));
-            }
+    // describes how the endpoint is calculated for a joint configuration
+    class ReachabilityMap::SamplingTask {
+    public:
+        boost::shared_ptr<KinematicModel > kin_model_;
+        boost::shared_ptr<self_collision::CollisionModel > col_model_;     // if set, self-colliding samples are rejected
+        std::string base_name_;                                             // if col_model_ is not set, endpoints are expressed in this frame
+        std::string effector_name_;
+        int effector_idx_;
+        std::set<int> excluded_link_idx_;
+        int ndof_;
+        Eigen::VectorXd lower_limit_;
+        Eigen::VectorXd upper_limit_;
+    };
 
-            // calculate forward kinematics for all links
-            for (int l_idx = 0; l_idx < col_model->getLinksCount(); l_idx++) {
-                kin_model->calculateFk(links_fk[l_idx], col_model->getLinkName(l_idx), tmp_q);
-            }
+    // Halton low-discrepancy sequence with optional random digit permutations
+    class ReachabilityMap::HaltonSequence {
+    public:
+        HaltonSequence(int dimensions, bool scrambled, unsigned int seed);
+        double get(int index, int dim_idx) const;
 
-            if (self_collision::checkCollision(col_model, links_fk, excluded_link_idx)) {
-                continue;
-            }
+        std::vector<int > bases_;
+        std::vector<std::vector<int > > permutations_;
+    };
 
-            const KDL::Frame &T_B_E = links_fk[effector_idx];
-            Eigen::VectorXd x(dim_);
-            for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
-                x(dim_idx) = T_B_E.p[dim_idx];
-                if (ep_min_(dim_idx) > x(dim_idx)) {
-                    ep_min_(dim_idx) = x(dim_idx);
-                }
-                if (ep_max_(dim_idx) < x(dim_idx)) {
-                    ep_max_(dim_idx) = x(dim_idx);
+    ReachabilityMap::HaltonSequence::HaltonSequence(int dimensions, bool scrambled, unsigned int seed) {
+        for (int p = 2; static_cast<int >(bases_.size()) < dimensions; p++) {
+            bool prime = true;
+            for (size_t i = 0; i < bases_.size() && bases_[i] * bases_[i] <= p; i++) {
+                if (p % bases_[i] == 0) {
+                    prime = false;
+                    break;
                 }
             }
-            ep_B_list.push_back(x);
+            if (prime) {
+                bases_.push_back(p);
+            }
         }
 
-        steps_.clear();
-        int map_size = 1;
-        for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
-            int steps = static_cast<int>( ceil( ( ep_max_(dim_idx) - ep_min_(dim_idx) ) / voxel_size_ ) );
-            steps_.push_back( steps );
-            map_size *= steps;
+        boost::random::mt19937 rng(seed);
+        permutations_.resize(dimensions);
+        for (int dim_idx = 0; dim_idx < dimensions; dim_idx++) {
+            std::vector<int > &perm = permutations_[dim_idx];
+            perm.resize(bases_[dim_idx]);
+            for (size_t i = 0; i < perm.size(); i++) {
+                perm[i] = i;
+            }
+            // the digit 0 is kept in place, so the trailing zeros do not change the value
+            if (scrambled) {
+                for (int i = perm.size() - 1; i > 1; i--) {
+                    int j = 1 + rng() % i;
+                    std::swap(perm[i], perm[j]);
+                }
+            }
         }
+    }
 
-        r_map_.resize(map_size, 0);
-        p_map_.resize(map_size, 0);
-
-        max_value_ = 0;
-        for (std::list<Eigen::VectorXd >::const_iterator it = ep_B_list.begin(); it != ep_B_list.end(); it++) {
-            int idx = getIndex( (*it) );
-            if (idx < 0) {
-                std::cout << "ERROR: ReachabilityMap::generate: idx < 0" << std::endl;
-            }
-            r_map_[idx]++;
-            if (r_map_[idx] > max_value_) {
-                max_value_ = r_map_[idx];
-            }
+    double ReachabilityMap::HaltonSequence::get(int index, int dim_idx) const {
+        const int base = bases_[dim_idx];
+        const std::vector<int > &perm = permutations_[dim_idx];
+        double inv_base = 1.0 / base;
+        double f = inv_base;
+        double result = 0.0;
+        while (index > 0) {
+            result += perm[index % base] * f;
+            index /= base;
+            f *= inv_base;
         }
+        return result;
     }
 
-    void ReachabilityMap::generateForArm(const boost::shared_ptr<KinematicModel> &kin_model, const std::string &base_name, const std::string &effector_name) {
-        std::list<Eigen::VectorXd > ep_B_list;
+    // state of a single sampling thread
+    class ReachabilityMap::SamplingWorker {
+    public:
+        SamplingWorker(const SamplingTask &task, const GenerationParams &params, const HaltonSequence *halton, int dim, double voxel_size);
+
+        bool calculateEndpoint(KDL::Frame &T_B_E);
+        void sampleChunks(int chunk_begin, int chunk_end, int chunks_stride, int samples_count, unsigned int seed);
+        void fillHistogram(const ReachabilityMap &map);
+        void addToGrid(const KDL::Frame &T_B_E);
+        void growGrid(const std::vector<int > &idx);
+
+        const SamplingTask &task_;
+        const HaltonSequence *halton_;
+        int dim_;
+        double voxel_size_;
+        bool streaming_;
+        Eigen::VectorXd q_;
+        std::vector<KDL::Frame > links_fk_;
+        std::vector<double > endpoints_;
+        std::vector<int > endpoint_bins_;
+        int valid_samples_count_;
+        Eigen::VectorXd ep_min_, ep_max_;
+        std::vector<int > histogram_;
+
+        // orientation bitsets, rot_words_ words for each voxel of histogram_
+        int rot_resolution_;
+        int rot_words_;
+        std::vector<boost::uint64_t > rot_histogram_;
+
+        // streaming mode: histogram_ covers voxels grid_min_ .. grid_min_+grid_steps_-1,
+        // expressed as multiples of voxel_size_
+        std::vector<int > grid_min_;
+        std::vector<int > grid_steps_;
+        std::vector<int > occupied_min_;
+        std::vector<int > occupied_max_;
+        std::vector<int > idx_;
+    };
+
+    static const int SAMPLES_CHUNK_SIZE = 1000;
+    static const int GRID_GROW_MARGIN = 8;
+
+    ReachabilityMap::SamplingWorker::SamplingWorker(const SamplingTask &task, const GenerationParams &params, const HaltonSequence *halton, int dim, double voxel_size) :
+        task_(task),
+        halton_(halton),
+        dim_(dim),
+        voxel_size_(voxel_size),
+        streaming_(params.streaming_ || params.batch_size_ > 0),
+        q_(task.ndof_),
+        valid_samples_count_(0),
+        ep_min_(dim),
+        ep_max_(dim),
+        rot_resolution_(params.orientation_resolution_),
+        rot_words_(params.orientation_resolution_ > 0 ? (4 * params.orientation_resolution_ * params.orientation_resolution_ * params.orientation_resolution_ + 63) / 64 : 0),
+        occupied_min_(dim, 1000000000),
+        occupied_max_(dim, -1000000000),
+        idx_(dim)
+    {
+        if (task_.col_model_) {
+            links_fk_.resize(task_.col_model_->getLinksCount());
+        }
         for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
             ep_min_(dim_idx) = 1000000.0;
             ep_max_(dim_idx) = -1000000.0;
         }
 
-        Eigen::VectorXd tmp_q(kin_model->getDofCount());
-        for (int i = 0; i < 1000000; i++) {
-            for (int q_idx = 0; q_idx < kin_model->getDofCount(); q_idx++) {
-                tmp_q(q_idx) = randomUniform(kin_model->getLowerLimit(q_idx), kin_model->getUpperLimit(q_idx));
-            }
-
-            KDL::Frame T_W_A, T_W_E;
-            kin_model->calculateFk(T_W_A, base_name, tmp_q);
-            kin_model->calculateFk(T_W_E, effector_name, tmp_q);
-
-            KDL::Frame T_A_E = T_W_A.Inverse() * T_W_E;
-
-            Eigen::VectorXd x(dim_);
+        if (streaming_ && params.lower_bound_.size() == dim_ && params.upper_bound_.size() == dim_) {
+            int map_size = 1;
             for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
-                x(dim_idx) = T_A_E.p[dim_idx];
-                if (ep_min_(dim_idx) > x(dim_idx)) {
-                    ep_min_(dim_idx) = x(dim_idx);
-                }
-                if (ep_max_(dim_idx) < x(dim_idx)) {
-                    ep_max_(dim_idx) = x(dim_idx);
-                }
-            }
-            ep_B_list.push_back(x);
+                int idx_min = static_cast<int >( floor( params.lower_bound_(dim_idx) / voxel_size_ ) );
+                int idx_max = static_cast<int >( floor( params.upper_bound_(dim_idx) / voxel_size_ ) );
+                grid_min_.push_back(idx_min);
+                grid_steps_.push_back( std::max(1, idx_max - idx_min + 1) );
+                map_size *= grid_steps_[dim_idx];
+            }
+            histogram_.assign(map_size, 0);
+            rot_histogram_.assign(map_size * rot_words_, 0);
         }
+    }
 
-        steps_.clear();
-        int map_size = 1;
+    void ReachabilityMap::SamplingWorker::addToGrid(const KDL::Frame &T_B_E) {
+        bool inside = !grid_steps_.empty();
         for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
-            int steps = static_cast<int>( ceil( ( ep_max_(dim_idx) - ep_min_(dim_idx) ) / voxel_size_ ) );
-            steps_.push_back( steps );
-            map_size *= steps;
-        }
-
-        r_map_.resize(map_size, 0);
-        p_map_.resize(map_size, 0);
-//        r_map_rot_.resize(map_size, 0);
-
-        max_value_ = 0;
-        for (std::list<Eigen::VectorXd >::const_iterator it = ep_B_list.begin(); it != ep_B_list.end(); it++) {
-            int idx = getIndex( (*it) );
-            if (idx < 0) {
-                std::cout << "ERROR: ReachabilityMap::generate: idx < 0" << std::endl;
-            }
-            r_map_[idx]++;
-            if (r_map_[idx] > max_value_) {
-                max_value_ = r_map_[idx];
+            idx_[dim_idx] = static_cast<int >( floor( T_B_E.p[dim_idx] / voxel_size_ ) );
+            if (inside && (idx_[dim_idx] < grid_min_[dim_idx] || idx_[dim_idx] >= grid_min_[dim_idx] + grid_steps_[dim_idx])) {
+                inside = false;
             }
         }
-    }
 
-    void ReachabilityMap::generate(const Eigen::VectorXd &lower_bound, const Eigen::VectorXd &upper_bound) {
-        ep_min_ = lower_bound;
-        ep_max_ = upper_bound;
+        if (!inside) {
+            growGrid(idx_);
+        }
 
-        steps_.clear();
-        int map_size = 1;
+        int total_idx = 0;
         for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
-            int steps = static_cast<int>( ceil( ( ep_max_(dim_idx) - ep_min_(dim_idx) ) / voxel_size_ ) );
-            steps_.push_back( steps );
-            map_size *= steps;
+            total_idx = total_idx * grid_steps_[dim_idx] + idx_[dim_idx] - grid_min_[dim_idx];
+            occupied_min_[dim_idx] = std::min(occupied_min_[dim_idx], idx_[dim_idx]);
+            occupied_max_[dim_idx] = std::max(occupied_max_[dim_idx], idx_[dim_idx]);
         }
+        histogram_[total_idx]++;
 
-        r_map_.resize(map_size, 0);
-        p_map_.resize(map_size, 0);
-        d_map_.resize(map_size, 0);
-        dd_map_.resize(map_size);
-        max_value_ = 0;
-    }
-
-
-
-    double ReachabilityMap::getValue(const Eigen::VectorXd &x) const {
-        int idx = getIndex(x);
-        if (idx < 0) {
-            return 0;
+        if (rot_words_ > 0) {
+            int bin = getOrientationBin(T_B_E.M, rot_resolution_);
+            rot_histogram_[total_idx * rot_words_ + bin / 64] |= (boost::uint64_t(1) << (bin % 64));
         }
-        // TODO: check what happens if the score is below 0
-        return static_cast<double >(r_map_[idx] - p_map_[idx]) / static_cast<double >(max_value_);
     }
 
-    void ReachabilityMap::setValue(const Eigen::VectorXd &x, int value) {
-        int idx = getIndex(x);
-        if (idx < 0) {
-            return;
+    void ReachabilityMap::SamplingWorker::growGrid(const std::vector<int > &idx) {
+        // the grid is extended by at least half of its size, so the cost of
+        // re-binning is amortized over the samples
+        std::vector<int > new_min(dim_), new_steps(dim_);
+        int map_size = 1;
+        for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
+            if (grid_steps_.empty()) {
+                new_min[dim_idx] = idx[dim_idx] - GRID_GROW_MARGIN;
+                new_steps[dim_idx] = 2 * GRID_GROW_MARGIN + 1;
+            }
+            else {
+                int margin = std::max(GRID_GROW_MARGIN, grid_steps_[dim_idx] / 2);
+                int lo = grid_min_[dim_idx];
+                int hi = grid_min_[dim_idx] + grid_steps_[dim_idx];
+                if (idx[dim_idx] < lo) {
+                    lo = idx[dim_idx] - margin;
+                }
+                if (idx[dim_idx] >= hi) {
+                    hi = idx[dim_idx] + 1 + margin;
+                }
+                new_min[dim_idx] = lo;
+                new_steps[dim_idx] = hi - lo;
+            }
+            map_size *= new_steps[dim_idx];
         }
-        r_map_[idx] = value;
-        if (r_map_[idx] > max_value_) {
-            max_value_ = r_map_[idx];
+
+        std::vector<int > new_histogram(map_size, 0);
+        std::vector<boost::uint64_t > new_rot_histogram(map_size * rot_words_, 0);
+        for (size_t old_idx = 0; old_idx < histogram_.size(); old_idx++) {
+            if (histogram_[old_idx] == 0) {
+                continue;
+            }
+            int rest = old_idx;
+            int new_idx = 0;
+            int stride = 1;
+            for (int dim_idx = dim_-1; dim_idx >= 0; dim_idx--) {
+                int i = rest % grid_steps_[dim_idx] + grid_min_[dim_idx] - new_min[dim_idx];
+                rest /= grid_steps_[dim_idx];
+                new_idx += i * stride;
+                stride *= new_steps[dim_idx];
+            }
+            new_histogram[new_idx] = histogram_[old_idx];
+            for (int w = 0; w < rot_words_; w++) {
+                new_rot_histogram[new_idx * rot_words_ + w] = rot_histogram_[old_idx * rot_words_ + w];
+            }
         }
+
+        histogram_.swap(new_histogram);
+        rot_histogram_.swap(new_rot_histogram);
+        grid_min_ = new_min;
+        grid_steps_ = new_steps;
     }
 
-    void ReachabilityMap::clear() {
-        for (int idx = 0; idx < r_map_.size(); idx++) {
-            r_map_[idx] = 0;
+    bool ReachabilityMap::SamplingWorker::calculateEndpoint(KDL::Frame &T_B_E) {
+        if (task_.col_model_) {
+            // calculate forward kinematics for all links
+            for (int l_idx = 0; l_idx < task_.col_model_->getLinksCount(); l_idx++) {
+                task_.kin_model_->calculateFk(links_fk_[l_idx], task_.col_model_->getLinkName(l_idx), q_);
+            }
+
+            if (self_collision::checkCollision(task_.col_model_, links_fk_, task_.excluded_link_idx_)) {
+                return false;
+            }
+            T_B_E = links_fk_[task_.effector_idx_];
+            return true;
         }
-        max_value_ = 0;
-    }
 
-    void ReachabilityMap::recurenceGrow(const std::list<Eigen::Vector3i > &states_to_expand, boost::function<bool(const KDL::Vector &x)> collision_func, const KDL::Vector &lower_bound, const KDL::Vector &upper_bound) {
-        std::list<Eigen::Vector3i > added_states;
+        KDL::Frame T_W_A, T_W_E;
+        task_.kin_model_->calculateFk(T_W_A, task_.base_name_, q_);
+        task_.kin_model_->calculateFk(T_W_E, task_.effector_name_, q_);
+        T_B_E = T_W_A.Inverse() * T_W_E;
+        return true;
+    }
 
-        for (std::list<Eigen::Vector3i >::const_iterator it = states_to_expand.begin(); it != states_to_expand.end(); it++) {
-            int current_idx = composeIndex( (*it) );
-            double current_val = d_map_[current_idx];
-            Eigen::Vector3i indices[6] = {
-            Eigen::Vector3i(-1, 0, 0) + (*it),
-            Eigen::Vector3i(+1, 0, 0) + (*it),
-            Eigen::Vector3i(0, -1, 0) + (*it),
-            Eigen::Vector3i(0, +1, 0) + (*it),
-            Eigen::Vector3i(0, 0, -1) + (*it),
-            Eigen::Vector3i(0, 0, +1) + (*it),
-            };
+    void ReachabilityMap::SamplingWorker::sampleChunks(int chunk_begin, int chunk_end, int chunks_stride, int samples_count, unsigned int seed) {
+        boost::random::uniform_real_distribution<double > uniform(0.0, 1.0);
+        for (int chunk_idx = chunk_begin; chunk_idx < chunk_end && chunk_idx * SAMPLES_CHUNK_SIZE < samples_count; chunk_idx += chunks_stride) {
+            boost::uint32_t seeds[2] = {seed, static_cast<boost::uint32_t >(chunk_idx)};
+            boost::random::seed_seq seq(seeds, seeds + 2);
+            boost::random::mt19937 rng(seq);
+
+            int samples_end = std::min(samples_count, (chunk_idx + 1) * SAMPLES_CHUNK_SIZE);
+            for (int i = chunk_idx * SAMPLES_CHUNK_SIZE; i < samples_end; i++) {
+                for (int q_idx = 0; q_idx < task_.ndof_; q_idx++) {
+                    // the first point of the Halton sequence is skipped, as it is 0 in all dimensions
+                    double u = (halton_ ? halton_->get(i + 1, q_idx) : uniform(rng));
+                    q_(q_idx) = task_.lower_limit_(q_idx) + (task_.upper_limit_(q_idx) - task_.lower_limit_(q_idx)) * u;
+                }
 
-            for (int i = 0; i < 6; i++) {
-                bool wrong_idx = false;
-                for (int dim_idx = 0; dim_idx < 3; dim_idx++) {
-                    if (indices[i][dim_idx] < 0 || indices[i][dim_idx] >= steps_[dim_idx]) {
-                        wrong_idx = true;
-                        break;
-                    }
+                KDL::Frame T_B_E;
+                if (!calculateEndpoint(T_B_E)) {
+                    continue;
                 }
-                if (wrong_idx) {
+                valid_samples_count_++;
+
+                if (streaming_) {
+                    addToGrid(T_B_E);
                     continue;
                 }
 
-                int pt_idx = composeIndex(indices[i][0], indices[i][1], indices[i][2]);
-                if (d_map_[pt_idx] == -1.0) {
-                    KDL::Vector pt;
-                    getIndexCenter(indices[i][0], indices[i][1], indices[i][2], pt);
-                    if (getIndex(pt) != pt_idx) {
-                        std::cout << "ERROR: ReachabilityMap::recurenceGrow: getIndex(pt) != pt_idx " << getIndex(pt) << " != " << pt_idx << std::endl;
-                    }
-                    if (collision_func(pt)) {
-                        d_map_[pt_idx] = -2.0;
+                for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
+                    double x = T_B_E.p[dim_idx];
+                    if (ep_min_(dim_idx) > x) {
+                        ep_min_(dim_idx) = x;
                     }
-                    else {
-                        d_map_[pt_idx] = current_val + voxel_size_;
-                        added_states.push_back( Eigen::Vector3i(indices[i][0], indices[i][1], indices[i][2]) );
+                    if (ep_max_(dim_idx) < x) {
+                        ep_max_(dim_idx) = x;
                     }
+                    endpoints_.push_back(x);
                 }
-                else if (d_map_[pt_idx] >= 0.0) {
-                    // sanity check
-                    if (d_map_[pt_idx] > current_val + voxel_size_) {
-                        std::cout << "ERROR: ReachabilityMap::recurenceGrow" << std::endl;
-                        return;
-                    }
+                if (rot_words_ > 0) {
+                    endpoint_bins_.push_back( getOrientationBin(T_B_E.M, rot_resolution_) );
                 }
             }
         }
+    }
 
-        if (!added_states.empty()) {
-            recurenceGrow(added_states, collision_func, lower_bound, upper_bound);
+    void ReachabilityMap::SamplingWorker::fillHistogram(const ReachabilityMap &map) {
+        histogram_.assign(map.r_map_.size(), 0);
+        rot_histogram_.assign(map.r_map_.size() * rot_words_, 0);
+        for (size_t i = 0; i < endpoints_.size(); i += dim_) {
+            int idx = map.getIndex(&endpoints_[i]);
+            if (idx < 0) {
+                std::cout << "ERROR: ReachabilityMap::generate: idx < 0" << std::endl;
+                continue;
+            }
+            histogram_[idx]++;
+            if (rot_words_ > 0) {
+                int bin = endpoint_bins_[i / dim_];
+                rot_histogram_[idx * rot_words_ + bin / 64] |= (boost::uint64_t(1) << (bin % 64));
+            }
         }
+        std::vector<double >().swap(endpoints_);
+        std::vector<int >().swap(endpoint_bins_);
     }
 
-    bool ReachabilityMap::createDistanceMap(const KDL::Vector &origin, boost::function<bool(const KDL::Vector &x)> collision_func, const KDL::Vector &lower_bound, const KDL::Vector &upper_bound) {
-        Eigen::VectorXd l_bound(3), u_bound(3);
-        for (int i = 0; i < 3; i++) {
-            l_bound(i) = lower_bound[i];
-            u_bound(i) = upper_bound[i];
+    void ReachabilityMap::runSampling(const std::vector<boost::shared_ptr<SamplingWorker > > &workers, int chunk_begin, int chunk_end, const GenerationParams &params) {
+        int threads_count = workers.size();
+        if (threads_count == 1) {
+            workers[0]->sampleChunks(chunk_begin, chunk_end, 1, params.samples_count_, params.seed_);
+            return;
         }
-        generate(l_bound, u_bound);
 
-//        std::cout << "ReachabilityMap::createDistanceMap: distance map size: " << d_map_.size() << std::endl;
+        boost::thread_group threads;
+        for (int t = 0; t < threads_count; t++) {
+            threads.create_thread( boost::bind(&SamplingWorker::sampleChunks, workers[t].get(), chunk_begin + t, chunk_end, threads_count, params.samples_count_, params.seed_) );
+        }
+        threads.join_all();
+    }
+
+    void ReachabilityMap::generateFromSamples(const SamplingTask &task, const GenerationParams &params) {
+        boost::posix_time::ptime start_time = boost::posix_time::microsec_clock::universal_time();
+        int threads_count = std::max(1, params.threads_count_);
+        bool adaptive = (params.batch_size_ > 0);
 
-        for (int idx = 0; idx < d_map_.size(); idx++) {
-            d_map_[idx] = -1.0;
+        boost::shared_ptr<HaltonSequence > halton;
+        if (params.sampler_ == GenerationParams::SAMPLER_HALTON) {
+            halton.reset( new HaltonSequence(task.ndof_, params.scrambled_, params.seed_) );
         }
 
-        if (getIndex(origin) < 0) {
-            std::cout << "ReachabilityMap::createDistanceMap: getIndex(origin) < 0" << std::endl;
-            return false;
+        std::vector<boost::shared_ptr<SamplingWorker > > workers;
+        for (int t = 0; t < threads_count; t++) {
+            workers.push_back( boost::shared_ptr<SamplingWorker >(new SamplingWorker(task, params, halton.get(), dim_, voxel_size_)) );
         }
 
-        origin_ = origin;
+        int chunks_count = (params.samples_count_ + SAMPLES_CHUNK_SIZE - 1) / SAMPLES_CHUNK_SIZE;
+        int batch_chunks = chunks_count;
+        if (adaptive) {
+            batch_chunks = std::max(1, (params.batch_size_ + SAMPLES_CHUNK_SIZE - 1) / SAMPLES_CHUNK_SIZE);
+        }
 
-        int ix = getIndexDim(origin[0], 0);
-        int iy = getIndexDim(origin[1], 1);
-        int iz = getIndexDim(origin[2], 2);
+        rot_resolution_ = std::max(0, params.orientation_resolution_);
+        rot_words_ = workers[0]->rot_words_;
 
-        // start at the origin
-        d_map_[composeIndex(ix, iy, iz)] = 0.0;
+        generation_stats_ = GenerationStats();
+        std::vector<int > prev_map, prev_min, prev_steps;
+        for (int chunk_begin = 0; chunk_begin < chunks_count; chunk_begin += batch_chunks) {
+            int chunk_end = std::min(chunks_count, chunk_begin + batch_chunks);
+            runSampling(workers, chunk_begin, chunk_end, params);
+
+            generation_stats_.batches_count_++;
+            generation_stats_.samples_count_ = std::min(params.samples_count_, chunk_end * SAMPLES_CHUNK_SIZE);
+            generation_stats_.time_ = (boost::posix_time::microsec_clock::universal_time() - start_time).total_microseconds() * 0.000001;
+            if (!adaptive) {
+                break;
+            }
+
+            mergeStreamingGrids(workers);
+            updateConvergence(prev_map, prev_min, prev_steps, params.tolerance_);
+            generation_stats_.batch_samples_count_.push_back(generation_stats_.samples_count_);
+            generation_stats_.batch_occupied_voxels_count_.push_back(generation_stats_.occupied_voxels_count_);
+            if (generation_stats_.converged_ || (params.time_budget_ > 0.0 && generation_stats_.time_ >= params.time_budget_)) {
+                break;
+            }
+            r_map_.copyTo(prev_map);
+            prev_min.resize(dim_);
+            for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
+                prev_min[dim_idx] = static_cast<int >( floor( ep_min_(dim_idx) / voxel_size_ + 0.5 ) );
+            }
+            prev_steps = steps_;
+        }
+
+        for (int t = 0; t < threads_count; t++) {
+            generation_stats_.valid_samples_count_ += workers[t]->valid_samples_count_;
+        }
+
+        if (!adaptive) {
+            if (params.streaming_) {
+                mergeStreamingGrids(workers);
+            }
+            else {
+                mergeBufferedSamples(workers);
+            }
+        }
+
+        generation_stats_.occupied_voxels_count_ = 0;
+        for (size_t idx = 0; idx < r_map_.size(); idx++) {
+            if (r_map_.get(idx) > 0) {
+                generation_stats_.occupied_voxels_count_++;
+            }
+        }
+        generation_stats_.time_ = (boost::posix_time::microsec_clock::universal_time() - start_time).total_microseconds() * 0.000001;
+    }
+
+    void ReachabilityMap::updateConvergence(const std::vector<int > &prev_map, const std::vector<int > &prev_min, const std::vector<int > &prev_steps, double tolerance) {
+        // the current map covers the previous one, as the occupied region can only grow
+        double total = 0.0, prev_total = 0.0;
+        generation_stats_.occupied_voxels_count_ = 0;
+        for (size_t idx = 0; idx < r_map_.size(); idx++) {
+            total += r_map_.get(idx);
+            if (r_map_.get(idx) > 0) {
+                generation_stats_.occupied_voxels_count_++;
+            }
+        }
+        for (size_t idx = 0; idx < prev_map.size(); idx++) {
+            prev_total += prev_map[idx];
+        }
 
+        if (prev_map.empty() || total == 0.0 || prev_total == 0.0) {
+            return;
+        }
+
+        std::vector<int > offset(dim_);
+        for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
+            offset[dim_idx] = prev_min[dim_idx] - static_cast<int >( floor( ep_min_(dim_idx) / voxel_size_ + 0.5 ) );
+        }
+
+        std::vector<bool > visited(r_map_.size(), false);
+        int occupied = 0;
+        int new_occupied = 0;
+        double l1_change = 0.0;
+        for (size_t prev_idx = 0; prev_idx < prev_map.size(); prev_idx++) {
+            int rest = prev_idx;
+            int idx = 0;
+            int stride = 1;
+            for (int dim_idx = dim_-1; dim_idx >= 0; dim_idx--) {
+                idx += (rest % prev_steps[dim_idx] + offset[dim_idx]) * stride;
+                rest /= prev_steps[dim_idx];
+                stride *= steps_[dim_idx];
+            }
+            visited[idx] = true;
+            l1_change += fabs(r_map_.get(idx) / total - prev_map[prev_idx] / prev_total);
+            if (r_map_.get(idx) > 0) {
+                occupied++;
+                if (prev_map[prev_idx] == 0) {
+                    new_occupied++;
+                }
+            }
+        }
+        for (size_t idx = 0; idx < r_map_.size(); idx++) {
+            if (!visited[idx] && r_map_.get(idx) > 0) {
+                l1_change += r_map_.get(idx) / total;
+                occupied++;
+                new_occupied++;
+            }
+        }
+
+        generation_stats_.new_voxels_fraction_ = static_cast<double >(new_occupied) / static_cast<double >(occupied);
+        generation_stats_.l1_change_ = l1_change;
+        generation_stats_.converged_ = (generation_stats_.new_voxels_fraction_ <= tolerance && generation_stats_.l1_change_ <= tolerance);
+    }
+
+    void ReachabilityMap::mergeBufferedSamples(const std::vector<boost::shared_ptr<SamplingWorker > > &workers) {
+        int threads_count = workers.size();
+        for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
+            ep_min_(dim_idx) = 1000000.0;
+            ep_max_(dim_idx) = -1000000.0;
+            for (int t = 0; t < threads_count; t++) {
+                ep_min_(dim_idx) = std::min(ep_min_(dim_idx), workers[t]->ep_min_(dim_idx));
+                ep_max_(dim_idx) = std::max(ep_max_(dim_idx), workers[t]->ep_max_(dim_idx));
+            }
+        }
+
+        if (ep_min_(0) > ep_max_(0)) {
+            std::cout << "ERROR: ReachabilityMap::generate: there are no valid samples" << std::endl;
+            return;
+        }
+
+        steps_.clear();
+        int map_size = 1;
+        for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
+            // the endpoint with the maximum coordinate must fall into the last voxel
+            int steps = static_cast<int>( floor( ( ep_max_(dim_idx) - ep_min_(dim_idx) ) / voxel_size_ ) ) + 1;
+            steps_.push_back( steps );
+            map_size *= steps;
+        }
+        updateLayout();
+
+        r_map_.reset(steps_, 1, 0);
+        p_map_.clear();
+        r_map_rot_.reset(steps_, rot_words_, 0);
+
+        if (threads_count == 1) {
+            workers[0]->fillHistogram(*this);
+        }
+        else {
+            boost::thread_group threads;
+            for (int t = 0; t < threads_count; t++) {
+                threads.create_thread( boost::bind(&SamplingWorker::fillHistogram, workers[t].get(), boost::cref(*this)) );
+            }
+            threads.join_all();
+        }
+
+        // merge the histograms of all threads
+        max_value_ = 0;
+        for (int idx = 0; idx < map_size; idx++) {
+            for (int t = 0; t < threads_count; t++) {
+                if (workers[t]->histogram_[idx] == 0) {
+                    continue;
+                }
+                r_map_[idx] += workers[t]->histogram_[idx];
+                for (int w = 0; w < rot_words_; w++) {
+                    r_map_rot_.set(idx * rot_words_ + w, r_map_rot_.get(idx * rot_words_ + w) | workers[t]->rot_histogram_[idx * rot_words_ + w]);
+                }
+            }
+            if (r_map_.get(idx) > max_value_) {
+                max_value_ = r_map_.get(idx);
+            }
+        }
+    }
+
+    void ReachabilityMap::mergeStreamingGrids(const std::vector<boost::shared_ptr<SamplingWorker > > &workers) {
+        // the map covers exactly the voxels that contain samples
+        std::vector<int > map_min(dim_, 1000000000), map_max(dim_, -1000000000);
+        for (size_t t = 0; t < workers.size(); t++) {
+            for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
+                map_min[dim_idx] = std::min(map_min[dim_idx], workers[t]->occupied_min_[dim_idx]);
+                map_max[dim_idx] = std::max(map_max[dim_idx], workers[t]->occupied_max_[dim_idx]);
+            }
+        }
+
+        if (map_min[0] > map_max[0]) {
+            std::cout << "ERROR: ReachabilityMap::generate: there are no valid samples" << std::endl;
+            return;
+        }
+
+        steps_.clear();
+        int map_size = 1;
+        for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
+            ep_min_(dim_idx) = map_min[dim_idx] * voxel_size_;
+            ep_max_(dim_idx) = (map_max[dim_idx] + 1) * voxel_size_;
+            steps_.push_back( map_max[dim_idx] - map_min[dim_idx] + 1 );
+            map_size *= steps_[dim_idx];
+        }
+        updateLayout();
+
+        r_map_.reset(steps_, 1, 0);
+        p_map_.clear();
+        r_map_rot_.reset(steps_, rot_words_, 0);
+
+        for (size_t t = 0; t < workers.size(); t++) {
+            const SamplingWorker &w = *(workers[t].get());
+            for (size_t grid_idx = 0; grid_idx < w.histogram_.size(); grid_idx++) {
+                if (w.histogram_[grid_idx] == 0) {
+                    continue;
+                }
+                int rest = grid_idx;
+                int total_idx = 0;
+                int stride = 1;
+                for (int dim_idx = dim_-1; dim_idx >= 0; dim_idx--) {
+                    int i = rest % w.grid_steps_[dim_idx] + w.grid_min_[dim_idx] - map_min[dim_idx];
+                    rest /= w.grid_steps_[dim_idx];
+                    total_idx += i * stride;
+                    stride *= steps_[dim_idx];
+                }
+                r_map_[total_idx] += w.histogram_[grid_idx];
+                for (int word = 0; word < rot_words_; word++) {
+                    r_map_rot_.set(total_idx * rot_words_ + word, r_map_rot_.get(total_idx * rot_words_ + word) | w.rot_histogram_[grid_idx * rot_words_ + word]);
+                }
+            }
+        }
+
+        max_value_ = 0;
+        for (int idx = 0; idx < map_size; idx++) {
+            if (r_map_.get(idx) > max_value_) {
+                max_value_ = r_map_.get(idx);
+            }
+        }
+    }
+
+    const ReachabilityMap::GenerationStats &ReachabilityMap::getGenerationStats() const {
+        return generation_stats_;
+    }
+
+    void ReachabilityMap::generate(const boost::shared_ptr<KinematicModel> &kin_model, const boost::shared_ptr<self_collision::CollisionModel> &col_model, const std::string &effector_name, int ndof, const Eigen::VectorXd &lower_limit, const Eigen::VectorXd &upper_limit) {
+        GenerationParams params;
+        params.samples_count_ = 100000;
+        params.seed_ = rand();
+        generate(kin_model, col_model, effector_name, ndof, lower_limit, upper_limit, params);
+    }
+
+    void ReachabilityMap::generate(const boost::shared_ptr<KinematicModel> &kin_model, const boost::shared_ptr<self_collision::CollisionModel> &col_model, const std::string &effector_name, int ndof, const Eigen::VectorXd &lower_limit, const Eigen::VectorXd &upper_limit, const GenerationParams &params) {
+        SamplingTask task;
+        task.kin_model_ = kin_model;
+        task.col_model_ = col_model;
+        task.effector_name_ = effector_name;
+        task.effector_idx_ = col_model->getLinkIndex(effector_name);
+        task.excluded_link_idx_.insert(col_model->getLinkIndex("env_link"));
+        task.ndof_ = ndof;
+        task.lower_limit_ = lower_limit;
+        task.upper_limit_ = upper_limit;
+
+        generateFromSamples(task, params);
+    }
+
+    void ReachabilityMap::generateForArm(const boost::shared_ptr<KinematicModel> &kin_model, const std::string &base_name, const std::string &effector_name) {
+        GenerationParams params;
+        params.samples_count_ = 1000000;
+        params.seed_ = rand();
+        generateForArm(kin_model, base_name, effector_name, params);
+    }
+
+    void ReachabilityMap::generateForArm(const boost::shared_ptr<KinematicModel> &kin_model, const std::string &base_name, const std::string &effector_name, const GenerationParams &params) {
+        SamplingTask task;
+        task.kin_model_ = kin_model;
+        task.base_name_ = base_name;
+        task.effector_name_ = effector_name;
+        task.effector_idx_ = -1;
+        task.ndof_ = kin_model->getDofCount();
+        task.lower_limit_.resize(task.ndof_);
+        task.upper_limit_.resize(task.ndof_);
+        for (int q_idx = 0; q_idx < task.ndof_; q_idx++) {
+            task.lower_limit_(q_idx) = kin_model->getLowerLimit(q_idx);
+            task.upper_limit_(q_idx) = kin_model->getUpperLimit(q_idx);
+        }
+
+        generateFromSamples(task, params);
+    }
+
+    void ReachabilityMap::generate(const Eigen::VectorXd &lower_bound, const Eigen::VectorXd &upper_bound) {
+        ep_min_ = lower_bound;
+        ep_max_ = upper_bound;
+
+        steps_.clear();
+        int map_size = 1;
+        for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
+            int steps = static_cast<int>( ceil( ( ep_max_(dim_idx) - ep_min_(dim_idx) ) / voxel_size_ ) );
+            steps_.push_back( steps );
+            map_size *= steps;
+        }
+        updateLayout();
+
+        r_map_.reset(steps_, 1, 0);
+        p_map_.clear();
+        r_map_rot_.clear();
+        rot_resolution_ = 0;
+        rot_words_ = 0;
+        // the distance map is allocated by initDistanceMap, and the derivatives only for
+        // the gradient field of the distance map
+        d_map_.clear();
+        descent_.clear();
+        flags_.clear();
+        parents_.clear();
+        occupancy_.clear();
+        max_value_ = 0;
+        coeff_cache_.reset();
+    }
+
+
+
+    double ReachabilityMap::getValue(const Eigen::VectorXd &x) const {
+        int idx = getIndex(x);
+        if (idx < 0 || r_map_.empty()) {
+            return 0;
+        }
+        int penalty = (p_map_.empty() ? 0 : p_map_[idx]);
+        // TODO: check what happens if the score is below 0
+        return static_cast<double >(r_map_[idx] - penalty) / static_cast<double >(max_value_);
+    }
+
+    int ReachabilityMap::getOrientationBin(const KDL::Rotation &rot, int resolution) {
+        // the unit quaternion is projected on the face of the 4D cube, determined by its largest
+        // component, and each of the remaining three components is divided into resolution bins
+        double q[4];
+        rot.GetQuaternion(q[0], q[1], q[2], q[3]);
+        int major = 0;
+        for (int i = 1; i < 4; i++) {
+            if (fabs(q[i]) > fabs(q[major])) {
+                major = i;
+            }
+        }
+        // q and -q represent the same rotation
+        double scale = (q[major] < 0.0 ? -1.0 : 1.0) / fabs(q[major]);
+        int bin = major;
+        for (int i = 0; i < 4; i++) {
+            if (i == major) {
+                continue;
+            }
+            int cell = static_cast<int >( (q[i] * scale + 1.0) * 0.5 * resolution );
+            bin = bin * resolution + std::max(0, std::min(resolution - 1, cell));
+        }
+        return bin;
+    }
+
+    double ReachabilityMap::getValue(const Eigen::VectorXd &x, const KDL::Rotation &rot) const {
+        int idx = getIndex(x);
+        if (idx < 0 || rot_words_ == 0) {
+            return 0;
+        }
+        int bin = getOrientationBin(rot, rot_resolution_);
+        if ((r_map_rot_[idx * rot_words_ + bin / 64] & (boost::uint64_t(1) << (bin % 64))) == 0) {
+            return 0;
+        }
+        return getValue(x);
+    }
+
+    double ReachabilityMap::getOrientationCoverage(const Eigen::VectorXd &x) const {
+        int idx = getIndex(x);
+        if (idx < 0 || rot_words_ == 0) {
+            return 0;
+        }
+        int bins_count = 0;
+        for (int w = 0; w < rot_words_; w++) {
+            for (boost::uint64_t word = r_map_rot_[idx * rot_words_ + w]; word != 0; word &= word - 1) {
+                bins_count++;
+            }
+        }
+        return static_cast<double >(bins_count) / static_cast<double >(4 * rot_resolution_ * rot_resolution_ * rot_resolution_);
+    }
+
+    void ReachabilityMap::setValue(const Eigen::VectorXd &x, int value) {
+        int idx = getIndex(x);
+        if (idx < 0) {
+            return;
+        }
+        r_map_[idx] = value;
+        if (r_map_[idx] > max_value_) {
+            max_value_ = r_map_[idx];
+        }
+    }
+
+    void ReachabilityMap::clear() {
+        r_map_.fill(0);
+        r_map_rot_.fill(0);
+        max_value_ = 0;
+    }
+
+    // parent direction of a voxel: the offset (dx, dy, dz) to its parent, coded as (dx+1)*9 + (dy+1)*3 + (dz+1)
+    static const unsigned char NO_PARENT = 0xFF;
+
+    static unsigned char encodeDirection(int dx, int dy, int dz) {
+        return static_cast<unsigned char >((dx + 1) * 9 + (dy + 1) * 3 + (dz + 1));
+    }
+
+    // occupancy bit of the voxel with the row-major index grid_idx
+    static inline bool isOccupied(const std::vector<boost::uint64_t > &occupancy, int grid_idx) {
+        return ((occupancy[grid_idx / 64] >> (grid_idx % 64)) & 1) != 0;
+    }
+
+    // the occupancy grid is computed in chunks of OCCUPANCY_CHUNK_WORDS words; the chunks are
+    // interleaved between the threads, as the cost of collision_func is usually not uniform
+    static const int OCCUPANCY_CHUNK_WORDS = 16;
+
+    void ReachabilityMap::computeOccupancyChunks(boost::function<void(int count, const KDL::Vector *x, unsigned char *collision)> collision_func, int chunk_begin, int chunk_end, int chunk_step, std::vector<boost::uint64_t > *occupancy) const {
+        int map_size = steps_[0] * steps_[1] * steps_[2];
+        std::vector<KDL::Vector > centres(OCCUPANCY_CHUNK_WORDS * 64);
+        std::vector<unsigned char > collision(OCCUPANCY_CHUNK_WORDS * 64);
+        for (int chunk = chunk_begin; chunk < chunk_end; chunk += chunk_step) {
+            int idx_begin = chunk * OCCUPANCY_CHUNK_WORDS * 64;
+            int count = std::min(map_size - idx_begin, OCCUPANCY_CHUNK_WORDS * 64);
+            for (int i = 0; i < count; i++) {
+                int idx = idx_begin + i;
+                getIndexCenter(idx / (steps_[1] * steps_[2]), (idx / steps_[2]) % steps_[1], idx % steps_[2], centres[i]);
+                collision[i] = 0;
+            }
+            collision_func(count, &centres[0], &collision[0]);
+            for (int i = 0; i < count; i++) {
+                if (collision[i] != 0) {
+                    (*occupancy)[(idx_begin + i) / 64] |= (boost::uint64_t(1) << (i % 64));
+                }
+            }
+        }
+    }
+
+    // occupancy grid of the map: one bit per voxel, in the row-major order, set for the voxels
+    // in collision; the threads write separate words of the grid
+    void ReachabilityMap::computeOccupancy(boost::function<void(int count, const KDL::Vector *x, unsigned char *collision)> collision_func, int threads_count, std::vector<boost::uint64_t > &occupancy) const {
+        int map_size = steps_[0] * steps_[1] * steps_[2];
+        occupancy.assign((map_size + 63) / 64, 0);
+        int chunks_count = (occupancy.size() + OCCUPANCY_CHUNK_WORDS - 1) / OCCUPANCY_CHUNK_WORDS;
+        threads_count = std::max(1, std::min(threads_count, chunks_count));
+        if (threads_count == 1) {
+            computeOccupancyChunks(collision_func, 0, chunks_count, 1, &occupancy);
+            return;
+        }
+        boost::thread_group threads;
+        for (int t = 0; t < threads_count; t++) {
+            threads.create_thread( boost::bind(&ReachabilityMap::computeOccupancyChunks, this, collision_func, t, chunks_count, threads_count, &occupancy) );
+        }
+        threads.join_all();
+    }
+
+    // the batched collision check of the per-point collision_func
+    class PointCollisionBatch {
+    public:
+        explicit PointCollisionBatch(const boost::function<bool(const KDL::Vector &x)> &collision_func) :
+            collision_func_(collision_func)
         {
-            std::list<Eigen::Vector3i > states_to_expand;
-            states_to_expand.push_back(Eigen::Vector3i(ix, iy, iz));
-            recurenceGrow(states_to_expand, collision_func, lower_bound, upper_bound);
         }
 
-        bounduary_set_.clear();
+        void operator()(int count, const KDL::Vector *x, unsigned char *collision) const {
+            for (int i = 0; i < count; i++) {
+                collision[i] = collision_func_(x[i]);
+            }
+        }
+
+    private:
+        boost::function<bool(const KDL::Vector &x)> collision_func_;
+    };
+
+    // the voxels in collision are taken from the occupancy grid if it is given, otherwise
+    // collision_func is called for each voxel next to the reached free space
+    void ReachabilityMap::growDistance(int origin_idx, boost::function<bool(const KDL::Vector &x)> collision_func, const std::vector<boost::uint64_t > *occupancy) {
+        // each voxel enters the queue at most once, so the queue is processed in a single buffer
+        // in the breadth-first order
+        std::vector<int > queue(d_map_.size());
+        int queue_begin = 0;
+        int queue_end = 0;
+        queue[queue_end++] = origin_idx;
+
+        const int dx[6] = {-1, 1, 0, 0, 0, 0};
+        const int dy[6] = {0, 0, -1, 1, 0, 0};
+        const int dz[6] = {0, 0, 0, 0, -1, 1};
+
+        while (queue_begin < queue_end) {
+            int current_idx = queue[queue_begin++];
+            double current_val = d_map_.get(current_idx);
+            int ix, iy, iz;
+            decomposeIndex(current_idx, ix, iy, iz);
+            const bool valid[6] = {ix > 0, ix < steps_[0]-1, iy > 0, iy < steps_[1]-1, iz > 0, iz < steps_[2]-1};
 
-        std::set<int > obstacle_ids;
-        for (int idx = 0; idx < d_map_.size(); idx++) {
-            if (d_map_[idx] < 0.0) {
-                obstacle_ids.insert(idx);
+            for (int i = 0; i < 6; i++) {
+                if (!valid[i]) {
+                    continue;
+                }
+                int pt_idx = composeIndex(ix + dx[i], iy + dy[i], iz + dz[i]);
+                if (d_map_.get(pt_idx) != -1.0) {
+                    continue;
+                }
+                bool collision;
+                if (occupancy != NULL) {
+                    collision = isOccupied(*occupancy, ((ix + dx[i]) * steps_[1] + iy + dy[i]) * steps_[2] + iz + dz[i]);
+                }
+                else {
+                    KDL::Vector pt;
+                    getIndexCenter(ix + dx[i], iy + dy[i], iz + dz[i], pt);
+                    collision = collision_func(pt);
+                }
+                if (collision) {
+                    d_map_[pt_idx] = -2.0;
+                    flags_.set(pt_idx, VOXEL_OBSTACLE);
+                }
+                else {
+                    d_map_[pt_idx] = current_val + voxel_size_;
+                    flags_.set(pt_idx, VOXEL_VISITED);
+                    parents_.set(pt_idx, encodeDirection(-dx[i], -dy[i], -dz[i]));
+                    queue[queue_end++] = pt_idx;
+                }
             }
         }
+    }
 
-        while (!obstacle_ids.empty()) {
-            std::set<std::pair<int, double> > neighbouring_ids;
-            for (std::set<int>::const_iterator it = obstacle_ids.begin(); it != obstacle_ids.end(); it++) {
+    // Distances read and written by the computation of the distance map. A map in another encoding
+    // than FLOAT64 (only during updateObstacles) keeps the written values exact until flush()
+    // encodes them, so the update reads the same values as the computation of a new map;
+    // the other voxels are decoded from the map. A FLOAT64 map is written at once.
+    class ReachabilityMap::DistanceOverlay {
+    public:
+        DistanceOverlay(DistanceStorage &d_map) :
+            d_map_(d_map),
+            direct_(d_map.getEncoding() == DistanceStorage::ENCODING_FLOAT64)
+        {
+        }
+
+        double get(int idx) const {
+            if (!direct_) {
+                boost::unordered_map<int, double >::const_iterator it = values_.find(idx);
+                if (it != values_.end()) {
+                    return it->second;
+                }
+            }
+            return d_map_.get(idx);
+        }
+
+        void set(int idx, double value) {
+            if (direct_) {
+                d_map_.set(idx, value);
+            }
+            else {
+                values_[idx] = value;
+            }
+        }
+
+        void flush() {
+            for (boost::unordered_map<int, double >::const_iterator it = values_.begin(); it != values_.end(); it++) {
+                d_map_.set(it->first, it->second);
+            }
+            values_.clear();
+        }
+
+    private:
+        DistanceStorage &d_map_;
+        bool direct_;
+        boost::unordered_map<int, double > values_;
+    };
+
+    // maximum non-negative distance in the neighbourhood of the voxel used for the obstacle interior:
+    // the voxels that differ from it in both x and y; -1 if there is no such voxel, otherwise
+    // max_idx is the voxel with the maximum
+    double ReachabilityMap::getMaxNeighbourDistance(const DistanceOverlay &distances, int ix, int iy, int iz, int &max_idx) const {
+        double max_value = -1.0;
+        for (int iix = std::max(0,ix-1); iix < std::min(steps_[0], ix+2); iix++) {
+            for (int iiy = std::max(0,iy-1); iiy < std::min(steps_[1], iy+2); iiy++) {
+                if (ix == iix || iy == iiy) {
+                    continue;
+                }
+                for (int iiz = std::max(0,iz-1); iiz < std::min(steps_[2], iz+2); iiz++) {
+                    int pt_idx = composeIndex(iix, iiy, iiz);
+                    double pt_val = distances.get(pt_idx);
+                    if (pt_val >= 0.0 && pt_val > max_value) {
+                        max_value = pt_val;
+                        max_idx = pt_idx;
+                    }
+                }
+            }
+        }
+        return max_value;
+    }
+
+    // fills the obstacle voxels layer by layer, each with the maximum distance of its neighbourhood
+    // (from the previous layers) plus voxel_size; only the neighbours of the voxels filled in
+    // the previous layer are candidates for the next one
+    void ReachabilityMap::fillObstacleDistance() {
+        std::vector<int > candidates;
+        for (int ix = 0; ix < steps_[0]; ix++) {
+            for (int iy = 0; iy < steps_[1]; iy++) {
+                for (int iz = 0; iz < steps_[2]; iz++) {
+                    int idx = composeIndex(ix, iy, iz);
+                    if (d_map_.get(idx) < 0.0) {
+                        candidates.push_back(idx);
+                    }
+                }
+            }
+        }
+        DistanceOverlay distances(d_map_);
+        fillObstacleDistance(distances, candidates);
+    }
+
+    // the same for the voxels of candidates, which are all the voxels with negative distance
+    // in their neighbourhood; candidates is used for the layers. The work depends only
+    // on the number of the filled voxels.
+    void ReachabilityMap::fillObstacleDistance(DistanceOverlay &distances, std::vector<int > &candidates) {
+        std::vector<std::pair<int, double> > layer;
+        std::vector<int > layer_parents;
+        while (!candidates.empty()) {
+            layer.clear();
+            layer_parents.clear();
+            for (size_t i = 0; i < candidates.size(); i++) {
                 int ix, iy, iz;
-                int idx = (*it);
-                decomposeIndex(idx, ix, iy, iz);
+                decomposeIndex(candidates[i], ix, iy, iz);
+                int max_idx;
+                double max_value = getMaxNeighbourDistance(distances, ix, iy, iz, max_idx);
+                if (max_value >= 0.0) {
+                    layer.push_back( std::make_pair(candidates[i], max_value) );
+                    layer_parents.push_back(max_idx);
+                }
+            }
+
+            for (size_t i = 0; i < layer.size(); i++) {
+                distances.set(layer[i].first, layer[i].second + voxel_size_);
+                int ix, iy, iz, px, py, pz;
+                decomposeIndex(layer[i].first, ix, iy, iz);
+                decomposeIndex(layer_parents[i], px, py, pz);
+                parents_.set(layer[i].first, encodeDirection(px - ix, py - iy, pz - iz));
+            }
 
-                double max_value = -0.01;
+            // the neighbourhood is symmetric
+            candidates.clear();
+            for (size_t i = 0; i < layer.size(); i++) {
+                int ix, iy, iz;
+                decomposeIndex(layer[i].first, ix, iy, iz);
                 for (int iix = std::max(0,ix-1); iix < std::min(steps_[0], ix+2); iix++) {
                     for (int iiy = std::max(0,iy-1); iiy < std::min(steps_[1], iy+2); iiy++) {
+                        if (ix == iix || iy == iiy) {
+                            continue;
+                        }
                         for (int iiz = std::max(0,iz-1); iiz < std::min(steps_[2], iz+2); iiz++) {
-                            if (ix == iix || iy == iiy || iy == iiy) {
-                                continue;
-                            }
                             int pt_idx = composeIndex(iix, iiy, iiz);
-                            double pt_val = d_map_[pt_idx];
-                            if (pt_val >= 0.0 && pt_val > max_value) {
-                                max_value = pt_val;
+                            if (distances.get(pt_idx) < 0.0) {
+                                candidates.push_back(pt_idx);
                             }
                         }
                     }
                 }
-                if (max_value >= 0.0) {
-                    neighbouring_ids.insert( std::make_pair(idx, max_value) );
+            }
+            std::sort(candidates.begin(), candidates.end());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+        }
+    }
+
+    // squared distance used for the voxels with no obstacle (or no free voxel) in the map
+    static const double EDT_INF = 1.0e20;
+
+    // 1-D squared Euclidean distance transform of the sampled function f (Felzenszwalb, Huttenlocher):
+    // the lower envelope of the parabolas rooted at the finite samples
+    static void distanceTransform1D(const double *f, int n, double *d, int *v, double *z) {
+        int k = -1;
+        for (int q = 0; q < n; q++) {
+            if (f[q] >= EDT_INF) {
+                continue;
+            }
+            double s = -EDT_INF;
+            while (k >= 0) {
+                s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2.0 * (q - v[k]));
+                if (s > z[k]) {
+                    break;
+                }
+                k--;
+            }
+            if (k < 0) {
+                s = -EDT_INF;
+            }
+            k++;
+            v[k] = q;
+            z[k] = s;
+        }
+
+        if (k < 0) {
+            for (int q = 0; q < n; q++) {
+                d[q] = EDT_INF;
+            }
+            return;
+        }
+
+        z[k+1] = EDT_INF;
+        int j = 0;
+        for (int q = 0; q < n; q++) {
+            while (z[j+1] < q) {
+                j++;
+            }
+            d[q] = (q - v[j]) * (q - v[j]) + f[v[j]];
+        }
+    }
+
+    // transforms the scanlines [line_begin, line_end) of the row-major grid along the axis
+    static void distanceTransformLines(double *grid, const std::vector<int > &steps, int axis, int line_begin, int line_end) {
+        int n = steps[axis];
+        std::vector<double > f(n), d(n), z(n + 1);
+        std::vector<int > v(n);
+        std::vector<int > strides(steps.size());
+        int stride = 1;
+        for (int dim_idx = steps.size() - 1; dim_idx >= 0; dim_idx--) {
+            strides[dim_idx] = stride;
+            stride *= steps[dim_idx];
+        }
+
+        for (int line = line_begin; line < line_end; line++) {
+            int rest = line;
+            int base = 0;
+            for (int dim_idx = steps.size() - 1; dim_idx >= 0; dim_idx--) {
+                if (dim_idx == axis) {
+                    continue;
                 }
+                base += (rest % steps[dim_idx]) * strides[dim_idx];
+                rest /= steps[dim_idx];
+            }
+            for (int q = 0; q < n; q++) {
+                f[q] = grid[base + q * strides[axis]];
+            }
+            distanceTransform1D(&f[0], n, &d[0], &v[0], &z[0]);
+            for (int q = 0; q < n; q++) {
+                grid[base + q * strides[axis]] = d[q];
+            }
+        }
+    }
+
+    // grid holds 0 for the seed voxels and EDT_INF for the other voxels;
+    // it is replaced with the squared distance to the nearest seed, in voxels
+    void ReachabilityMap::squaredDistanceTransform(std::vector<double > &grid, int threads_count) const {
+        for (size_t axis = 0; axis < steps_.size(); axis++) {
+            int lines_count = grid.size() / steps_[axis];
+            if (threads_count == 1) {
+                distanceTransformLines(&grid[0], steps_, axis, 0, lines_count);
+                continue;
+            }
+            boost::thread_group threads;
+            for (int t = 0; t < threads_count; t++) {
+                int line_begin = static_cast<int >( static_cast<long long >(lines_count) * t / threads_count );
+                int line_end = static_cast<int >( static_cast<long long >(lines_count) * (t + 1) / threads_count );
+                threads.create_thread( boost::bind(&distanceTransformLines, &grid[0], boost::cref(steps_), axis, line_begin, line_end) );
             }
+            threads.join_all();
+        }
+    }
+
+    void ReachabilityMap::createEuclideanDistanceMap(const std::vector<boost::uint64_t > &occupancy, int threads_count) {
+        // the transform works on the row-major grids, like the occupancy grid
+        int map_size = steps_[0] * steps_[1] * steps_[2];
+        std::vector<double > outside(map_size), inside(map_size);
+        for (int idx = 0; idx < map_size; idx++) {
+            bool occupied = isOccupied(occupancy, idx);
+            outside[idx] = (occupied ? 0.0 : EDT_INF);
+            inside[idx] = (occupied ? EDT_INF : 0.0);
+        }
+
+        squaredDistanceTransform(outside, threads_count);
+        squaredDistanceTransform(inside, threads_count);
+
+        // the surface lies between the centers of the free and the occupied voxels
+        double max_distance = sqrt(static_cast<double >(steps_[0] * steps_[0] + steps_[1] * steps_[1] + steps_[2] * steps_[2]));
+        for (int idx = 0; idx < map_size; idx++) {
+            int map_idx = composeIndex(idx / (steps_[1] * steps_[2]), (idx / steps_[2]) % steps_[1], idx % steps_[2]);
+            if (isOccupied(occupancy, idx)) {
+                double dist = (inside[idx] >= EDT_INF ? max_distance : sqrt(inside[idx]));
+                d_map_[map_idx] = -(dist - 0.5) * voxel_size_;
+                flags_.set(map_idx, VOXEL_OBSTACLE);
+            }
+            else {
+                double dist = (outside[idx] >= EDT_INF ? max_distance : sqrt(outside[idx]));
+                d_map_[map_idx] = (dist - 0.5) * voxel_size_;
+            }
+        }
+    }
+
+    bool ReachabilityMap::createDistanceMap(const KDL::Vector &origin, boost::function<bool(const KDL::Vector &x)> collision_func, const KDL::Vector &lower_bound, const KDL::Vector &upper_bound) {
+        return createDistanceMap(origin, collision_func, lower_bound, upper_bound, DistanceMapParams());
+    }
+
+    void ReachabilityMap::getDistanceMapSize(const KDL::Vector &lower_bound, const KDL::Vector &upper_bound, int &nx, int &ny, int &nz) const {
+        // the same as in generate()
+        nx = static_cast<int>( ceil( ( upper_bound[0] - lower_bound[0] ) / voxel_size_ ) );
+        ny = static_cast<int>( ceil( ( upper_bound[1] - lower_bound[1] ) / voxel_size_ ) );
+        nz = static_cast<int>( ceil( ( upper_bound[2] - lower_bound[2] ) / voxel_size_ ) );
+    }
+
+    // allocates the distance map for the bounds, with the distances set to -1
+    bool ReachabilityMap::initDistanceMap(const KDL::Vector &origin, const KDL::Vector &lower_bound, const KDL::Vector &upper_bound) {
+        Eigen::VectorXd l_bound(3), u_bound(3);
+        for (int i = 0; i < 3; i++) {
+            l_bound(i) = lower_bound[i];
+            u_bound(i) = upper_bound[i];
+        }
+        d_map_.clear();
+        d_map_.setEncoding(DistanceStorage::ENCODING_FLOAT64, distance_resolution_);
+        generate(l_bound, u_bound);
+
+//        std::cout << "ReachabilityMap::createDistanceMap: distance map size: " << d_map_.size() << std::endl;
+
+        d_map_.reset(layout_steps_, 1, -1.0);
+        flags_.reset(layout_steps_, 1, 0);
+        parents_.clear();
+
+        if (getIndex(origin) < 0) {
+            std::cout << "ReachabilityMap::createDistanceMap: getIndex(origin) < 0" << std::endl;
+            return false;
+        }
+
+        origin_ = origin;
+        return true;
+    }
+
+    bool ReachabilityMap::createDistanceMap(const KDL::Vector &origin, boost::function<bool(const KDL::Vector &x)> collision_func, const KDL::Vector &lower_bound, const KDL::Vector &upper_bound, const DistanceMapParams &params) {
+        if (!initDistanceMap(origin, lower_bound, upper_bound)) {
+            return false;
+        }
+
+        // METHOD_EDT needs the occupancy of all voxels anyway
+        std::vector<boost::uint64_t > occupancy;
+        if (params.precompute_occupancy_ || params.method_ == DistanceMapParams::METHOD_EDT) {
+            computeOccupancy(PointCollisionBatch(collision_func), (params.precompute_occupancy_ ? std::max(1, params.threads_count_) : 1), occupancy);
+        }
+
+        finishDistanceMap(collision_func, (occupancy.empty() ? NULL : &occupancy), params);
+        return true;
+    }
+
+    bool ReachabilityMap::createDistanceMap(const KDL::Vector &origin, const std::vector<boost::uint64_t > &occupancy, const KDL::Vector &lower_bound, const KDL::Vector &upper_bound, const DistanceMapParams &params) {
+        int nx, ny, nz;
+        getDistanceMapSize(lower_bound, upper_bound, nx, ny, nz);
+        if (occupancy.size() != (static_cast<size_t >(nx) * ny * nz + 63) / 64) {
+            std::cout << "ERROR: ReachabilityMap::createDistanceMap: wrong size of the occupancy grid: " << occupancy.size() << ", should be " << (static_cast<size_t >(nx) * ny * nz + 63) / 64 << std::endl;
+            return false;
+        }
+        if (!initDistanceMap(origin, lower_bound, upper_bound)) {
+            return false;
+        }
+        finishDistanceMap(boost::function<bool(const KDL::Vector &x)>(), &occupancy, params);
+        return true;
+    }
+
+    bool ReachabilityMap::createDistanceMap(const KDL::Vector &origin, const std::vector<unsigned char > &occupancy, const KDL::Vector &lower_bound, const KDL::Vector &upper_bound, const DistanceMapParams &params) {
+        int nx, ny, nz;
+        getDistanceMapSize(lower_bound, upper_bound, nx, ny, nz);
+        if (occupancy.size() != static_cast<size_t >(nx) * ny * nz) {
+            std::cout << "ERROR: ReachabilityMap::createDistanceMap: wrong size of the occupancy grid: " << occupancy.size() << ", should be " << static_cast<size_t >(nx) * ny * nz << std::endl;
+            return false;
+        }
+        if (!initDistanceMap(origin, lower_bound, upper_bound)) {
+            return false;
+        }
+        std::vector<boost::uint64_t > occupancy_bits((occupancy.size() + 63) / 64, 0);
+        for (size_t idx = 0; idx < occupancy.size(); idx++) {
+            if (occupancy[idx] != 0) {
+                occupancy_bits[idx / 64] |= (boost::uint64_t(1) << (idx % 64));
+            }
+        }
+        finishDistanceMap(boost::function<bool(const KDL::Vector &x)>(), &occupancy_bits, params);
+        return true;
+    }
+
+    bool ReachabilityMap::createDistanceMapBatched(const KDL::Vector &origin, boost::function<void(int count, const KDL::Vector *x, unsigned char *collision)> collision_func, const KDL::Vector &lower_bound, const KDL::Vector &upper_bound, const DistanceMapParams &params) {
+        if (!initDistanceMap(origin, lower_bound, upper_bound)) {
+            return false;
+        }
+        std::vector<boost::uint64_t > occupancy;
+        computeOccupancy(collision_func, (params.precompute_occupancy_ ? std::max(1, params.threads_count_) : 1), occupancy);
+        finishDistanceMap(boost::function<bool(const KDL::Vector &x)>(), &occupancy, params);
+        return true;
+    }
+
+    // computes the distance map allocated by initDistanceMap; the voxels in collision are taken
+    // from the occupancy grid, or from collision_func if it is NULL (only for METHOD_BFS)
+    void ReachabilityMap::finishDistanceMap(boost::function<bool(const KDL::Vector &x)> collision_func, const std::vector<boost::uint64_t > *occupancy, const DistanceMapParams &params) {
+        distance_params_ = params;
+        if (occupancy != NULL && params.method_ == DistanceMapParams::METHOD_BFS) {
+            occupancy_ = *occupancy;
+        }
+        else {
+            occupancy_.clear();
+        }
 
-            for (std::set<std::pair<int, double> >::const_iterator it = neighbouring_ids.begin(); it != neighbouring_ids.end(); it++) {
-                int idx = it->first;
-                double max_value = it->second;
-                d_map_[idx] = max_value + voxel_size_;
-                obstacle_ids.erase(idx);
+        if (params.method_ == DistanceMapParams::METHOD_EDT) {
+            createEuclideanDistanceMap(*occupancy, std::max(1, params.threads_count_));
+            if (params.gradient_field_) {
+                createGradientField(std::max(1, params.threads_count_));
             }
-            neighbouring_ids.clear();
+            d_map_.setEncoding(distance_encoding_, distance_resolution_);
+            resetCoefficientCache();
+            return;
         }
 
-        return true;
+        int ix = getIndexDim(origin_[0], 0);
+        int iy = getIndexDim(origin_[1], 1);
+        int iz = getIndexDim(origin_[2], 2);
 
-        for (int idx = 0; idx < d_map_.size(); idx++) {
-            if (d_map_[idx] < 0.0) {
-                double max_value = 0.0;
-                for (int iix = std::max(0,ix-1); iix < std::min(steps_[0], ix+2); iix++) {
-                    for (int iiy = std::max(0,iy-1); iiy < std::min(steps_[1], iy+2); iiy++) {
-                        for (int iiz = std::max(0,iz-1); iiz < std::min(steps_[2], iz+2); iiz++) {
-                            if (ix == iix || iy == iiy || iy == iiy) {
-                                continue;
-                            }
-                            int pt_idx = composeIndex(iix, iiy, iiz);
-                            double pt_val = d_map_[pt_idx];
-                            if (pt_val >= 0.0 && pt_val > max_value) {
-                                max_value = pt_val;
-                            }
-                        }
-                    }
-                }
+        parents_.reset(layout_steps_, 1, NO_PARENT);
 
+        // start at the origin
+        d_map_[composeIndex(ix, iy, iz)] = 0.0;
+        flags_.set(composeIndex(ix, iy, iz), VOXEL_VISITED);
 
-                d_map_[idx] = max_value + voxel_size_;
-                continue;
-            }
+        growDistance(composeIndex(ix, iy, iz), collision_func, occupancy);
 
-            continue;
+        fillObstacleDistance();
+        if (params.gradient_field_) {
+            createGradientField(std::max(1, params.threads_count_));
+        }
+        d_map_.setEncoding(distance_encoding_, distance_resolution_);
+        resetCoefficientCache();
+    }
 
-            int ix, iy, iz;
-            decomposeIndex(idx, ix, iy, iz);
+    bool ReachabilityMap::addObstacles(const std::vector<KDL::Vector > &points) {
+        return updateObstacles(points, std::vector<KDL::Vector >());
+    }
 
-            if (ix == 0 || ix >= steps_[0] - 1) {
-                continue;
-            }
-            if (iy == 0 || iy >= steps_[1] - 1) {
-                continue;
-            }
-            if (iz == 0 || iz >= steps_[2] - 1) {
-                continue;
-            }
+    bool ReachabilityMap::removeObstacles(const std::vector<KDL::Vector > &points) {
+        return updateObstacles(std::vector<KDL::Vector >(), points);
+    }
 
-            double min_value = d_map_[idx];
-            KDL::Vector min_gr;
-            for (int iix = std::max(0,ix-1); iix < std::min(steps_[0], ix+2); iix++) {
-                for (int iiy = std::max(0,iy-1); iiy < std::min(steps_[1], iy+2); iiy++) {
-                    for (int iiz = std::max(0,iz-1); iiz < std::min(steps_[2], iz+2); iiz++) {
-                        if (ix == iix || iy == iiy || iy == iiy) {
-                            continue;
-                        }
-                        int pt_idx = composeIndex(iix, iiy, iiz);
-                        double pt_val = d_map_[pt_idx];
-                        if (pt_val >= 0.0 && pt_val < min_value) {
-                            min_value = pt_val;
-                            min_gr = KDL::Vector(iix - ix, iiy - iy, iiz - iz);
-                        }
-                    }
-                }
-            }
-            min_gr.Normalize();
-            dd_map_[idx].dx_ = min_gr.x();
-            dd_map_[idx].dy_ = min_gr.y();
-            dd_map_[idx].dz_ = min_gr.z();
-            continue;
-
-
-
-            double deriv[16] = {
-                      // p n
-                0,    // 0 0
-                -1,   // 0 1
-                -1,   // 0 2
-                1,    // 0 3
-                1,    // 1 0
-                0,    // 1 1
-                1,    // 1 2
-                1,    // 1 3
-                1,    // 2 0
-                -1,   // 2 1
-                0,    // 2 2
-                1,    // 2 3
-                -1,   // 3 0
-                -1,   // 3 1
-                -1,   // 3 2
-                0,    // 3 3
-            };
+    bool ReachabilityMap::updateObstacles(const std::vector<KDL::Vector > &added, const std::vector<KDL::Vector > &removed) {
+        if (distance_params_.method_ != DistanceMapParams::METHOD_BFS) {
+            std::cout << "ERROR: ReachabilityMap::updateObstacles: only METHOD_BFS maps can be updated" << std::endl;
+            return false;
+        }
+        if (d_map_.empty() || occupancy_.empty()) {
+            std::cout << "ERROR: ReachabilityMap::updateObstacles: the distance map has no occupancy grid" << std::endl;
+            return false;
+        }
 
-/*
-            double deriv[16][2] = {
-                          // np
-                {0,0},    // 00
-                {1,0},    // 01
-                {0,0},    // 02
-                {-1,0},   // 03
-                {-1,0},   // 10
-                {0,-2},   // 11
-                {0,-1},   // 12
-                {-1,0},   // 13
-                {0,0},    // 20
-                {0,-1},   // 21
-                {0,0},    // 22
-                {0,1},    // 23
-                {1,0},    // 30
-                {1,0},    // 31
-                {0,1},    // 32
-                {0,2},    // 33
-            };
-
-            double deriv[16][2] = {
-                          // np
-                {0,0},    // 00
-                {0,1},    // 01
-                {0,0},    // 02
-                {0,-1},   // 03
-                {0,-1},   // 10
-                {-2,0},   // 11
-                {-1,0},   // 12
-                {0,-1},   // 13
-                {0,0},    // 20
-                {-1,0},   // 21
-                {0,0},    // 22
-                {1,0},    // 23
-                {0,1},    // 30
-                {0,1},    // 31
-                {1,0},    // 32
-                {2,0},    // 33
-            };
-//*/
-            int idxp, idxn;
-            idxp = composeIndex(ix-1, iy, iz);
-            idxn = composeIndex(ix+1, iy, iz);
-            // calculate partial derivatives for x
-            int vidx = 0;
-            if (ix == 0 || d_map_[idxp] < 0.0) {
-                vidx = 0;
-            }
-            else if (d_map_[idxp] < d_map_[idx]) {
-                vidx = 1 * 4;
-            }
-            else if (d_map_[idxp] == d_map_[idx]) {
-                vidx = 2 * 4;
-            }
-            else {
-                vidx = 3 * 4;
-            }
-            vidx = vidx;
-            if (ix == steps_[0]-1 || d_map_[idxn] < 0.0) {
-                vidx |= 0;
-            }
-            else if (d_map_[idxn] < d_map_[idx]) {
-                vidx |= 1;
+        std::vector<int > indices;
+        for (size_t i = 0; i < removed.size(); i++) {
+            int idx = getIndex(removed[i]);
+            if (idx >= 0) {
+                indices.push_back(idx);
             }
-            else if (d_map_[idxn] == d_map_[idx]) {
-                vidx |= 2;
-            }
-            else {
-                vidx |= 3;
+        }
+        size_t removed_count = indices.size();
+        for (size_t i = 0; i < added.size(); i++) {
+            int idx = getIndex(added[i]);
+            if (idx >= 0) {
+                indices.push_back(idx);
             }
+        }
 
-            dd_map_[idx].dx_ = deriv[vidx];
-
-            idxp = composeIndex(ix, iy-1, iz);
-            idxn = composeIndex(ix, iy+1, iz);
-
-            // calculate partial derivatives for y
-            vidx = 0;
-            if (iy == 0 || d_map_[idxp] < 0.0) {
-                vidx = 0;
-            }
-            else if (d_map_[idxp] < d_map_[idx]) {
-                vidx = 1 * 4;
-            }
-            else if (d_map_[idxp] == d_map_[idx]) {
-                vidx = 2 * 4;
+        // the occupancy before the update, so the voxels both removed and added are not changed
+        std::vector<std::pair<int, bool > > previous;
+        std::vector<int > grid_indices(indices.size());
+        for (size_t i = 0; i < indices.size(); i++) {
+            int ix, iy, iz;
+            decomposeIndex(indices[i], ix, iy, iz);
+            grid_indices[i] = (ix * steps_[1] + iy) * steps_[2] + iz;
+            previous.push_back( std::make_pair(indices[i], isOccupied(occupancy_, grid_indices[i])) );
+        }
+        for (size_t i = 0; i < indices.size(); i++) {
+            if (i < removed_count) {
+                occupancy_[grid_indices[i] / 64] &= ~(boost::uint64_t(1) << (grid_indices[i] % 64));
             }
             else {
-                vidx = 3 * 4;
-            }
-            vidx = vidx;
-            if (iy == steps_[1]-1 || d_map_[idxn] < 0.0) {
-                vidx |= 0;
-            }
-            else if (d_map_[idxn] < d_map_[idx]) {
-                vidx |= 1;
+                occupancy_[grid_indices[i] / 64] |= (boost::uint64_t(1) << (grid_indices[i] % 64));
             }
-            else if (d_map_[idxn] == d_map_[idx]) {
-                vidx |= 2;
-            }
-            else {
-                vidx |= 3;
+        }
+        std::sort(previous.begin(), previous.end());
+        previous.erase(std::unique(previous.begin(), previous.end()), previous.end());
+
+        std::vector<int > toggled;
+        for (size_t i = 0; i < previous.size(); i++) {
+            int ix, iy, iz;
+            decomposeIndex(previous[i].first, ix, iy, iz);
+            if (isOccupied(occupancy_, (ix * steps_[1] + iy) * steps_[2] + iz) != previous[i].second) {
+                toggled.push_back(previous[i].first);
             }
+        }
+        if (toggled.empty()) {
+            return true;
+        }
 
-            dd_map_[idx].dy_ = deriv[vidx];
+        // the derivatives are computed from the encoded distances, as in createDistanceMap
+        std::vector<int > changed;
+        repairDistanceMap(toggled, changed);
+        updateDistanceDerivatives(changed);
+        return true;
+    }
 
-            idxp = composeIndex(ix, iy, iz-1);
-            idxn = composeIndex(ix, iy, iz+1);
+    // number of voxel_size steps of a distance
+    static inline int getDistanceLevel(double distance, double voxel_size) {
+        return static_cast<int >( floor(distance / voxel_size + 0.5) );
+    }
 
-            // calculate partial derivatives for z
-            vidx = 0;
-            if (iz == 0 || d_map_[idxp] < 0.0) {
-                vidx = 0;
-            }
-            else if (d_map_[idxp] < d_map_[idx]) {
-                vidx = 1 * 4;
-            }
-            else if (d_map_[idxp] == d_map_[idx]) {
-                vidx = 2 * 4;
-            }
-            else {
-                vidx = 3 * 4;
-            }
-            vidx = vidx;
-            if (iz == steps_[2]-1 || d_map_[idxn] < 0.0) {
-                vidx |= 0;
+    // repairs the METHOD_BFS map after the occupancy of the toggled voxels is changed;
+    // changed gets the voxels with a changed distance
+    void ReachabilityMap::repairDistanceMap(const std::vector<int > &toggled, std::vector<int > &changed) {
+        const int dx[6] = {-1, 1, 0, 0, 0, 0};
+        const int dy[6] = {0, 0, -1, 1, 0, 0};
+        const int dz[6] = {0, 0, 0, 0, -1, 1};
+        // the origin is not checked for collision, as in growDistance
+        const int origin_idx = composeIndex(getIndexDim(origin_[0], 0), getIndexDim(origin_[1], 1), getIndexDim(origin_[2], 2));
+        DistanceOverlay distances(d_map_);
+
+        // Raise: the voxels that became occupied and the voxels reached only through them lose
+        // their distance, level by level. A child with another neighbour at the level of its parent
+        // only takes it as the new parent; the voxels of a level are all known when it is processed.
+        std::vector<std::vector<int > > buckets;
+        for (size_t i = 0; i < toggled.size(); i++) {
+            int idx = toggled[i];
+            if (idx == origin_idx || (flags_.get(idx) & VOXEL_VISITED) == 0) {
+                continue;
             }
-            else if (d_map_[idxp] < d_map_[idx]) {
-                vidx |= 1;
+            int level = getDistanceLevel(distances.get(idx), voxel_size_);
+            if (level >= static_cast<int >(buckets.size())) {
+                buckets.resize(level + 1);
             }
-            else if (d_map_[idxp] == d_map_[idx]) {
-                vidx |= 2;
+            buckets[level].push_back(idx);
+            flags_.set(idx, flags_.get(idx) & ~VOXEL_VISITED);
+        }
+
+        std::vector<int > raised;
+        for (int level = 0; level < static_cast<int >(buckets.size()); level++) {
+            for (size_t i = 0; i < buckets[level].size(); i++) {
+                int idx = buckets[level][i];
+                raised.push_back(idx);
+                int ix, iy, iz;
+                decomposeIndex(idx, ix, iy, iz);
+                const bool valid[6] = {ix > 0, ix < steps_[0]-1, iy > 0, iy < steps_[1]-1, iz > 0, iz < steps_[2]-1};
+                for (int j = 0; j < 6; j++) {
+                    if (!valid[j]) {
+                        continue;
+                    }
+                    int cx = ix + dx[j], cy = iy + dy[j], cz = iz + dz[j];
+                    int child_idx = composeIndex(cx, cy, cz);
+                    if ((flags_.get(child_idx) & VOXEL_VISITED) == 0 || parents_.get(child_idx) != encodeDirection(-dx[j], -dy[j], -dz[j])) {
+                        continue;
+                    }
+                    bool reparented = false;
+                    for (int k = 0; k < 6 && !reparented; k++) {
+                        int px = cx + dx[k], py = cy + dy[k], pz = cz + dz[k];
+                        if (px < 0 || px >= steps_[0] || py < 0 || py >= steps_[1] || pz < 0 || pz >= steps_[2]) {
+                            continue;
+                        }
+                        int p_idx = composeIndex(px, py, pz);
+                        if ((flags_.get(p_idx) & VOXEL_VISITED) != 0 && getDistanceLevel(distances.get(p_idx), voxel_size_) == level) {
+                            parents_.set(child_idx, encodeDirection(dx[k], dy[k], dz[k]));
+                            reparented = true;
+                        }
+                    }
+                    if (!reparented) {
+                        flags_.set(child_idx, flags_.get(child_idx) & ~VOXEL_VISITED);
+                        if (level + 1 >= static_cast<int >(buckets.size())) {
+                            buckets.resize(level + 2);
+                        }
+                        buckets[level + 1].push_back(child_idx);
+                    }
+                }
             }
-            else {
-                vidx |= 3;
+        }
+        for (size_t i = 0; i < raised.size(); i++) {
+            distances.set(raised[i], -1.0);
+            parents_.set(raised[i], NO_PARENT);
+        }
+        changed = raised;
+
+        // Lower: the BFS continues from the reached voxels next to the raised and the freed voxels,
+        // in the order of levels, and updates the voxels it reaches with a lower level.
+        // The distances of the levels are summed as in growDistance.
+        buckets.clear();
+        std::vector<int > reached;
+        std::vector<double > level_distance(1, 0.0);
+        std::vector<int > sources(toggled);
+        sources.insert(sources.end(), raised.begin(), raised.end());
+        for (size_t i = 0; i < sources.size(); i++) {
+            int ix, iy, iz;
+            decomposeIndex(sources[i], ix, iy, iz);
+            const bool valid[6] = {ix > 0, ix < steps_[0]-1, iy > 0, iy < steps_[1]-1, iz > 0, iz < steps_[2]-1};
+            for (int j = 0; j < 6; j++) {
+                int n_idx = (valid[j] ? composeIndex(ix + dx[j], iy + dy[j], iz + dz[j]) : -1);
+                if (n_idx < 0 || (flags_.get(n_idx) & VOXEL_VISITED) == 0) {
+                    continue;
+                }
+                int level = getDistanceLevel(distances.get(n_idx), voxel_size_);
+                if (level >= static_cast<int >(buckets.size())) {
+                    buckets.resize(level + 1);
+                }
+                buckets[level].push_back(n_idx);
             }
+        }
 
-            dd_map_[idx].dz_ = deriv[vidx];
-
-/*
-
-            idxp = composeIndex(ix-1, iy, iz);
-            idxn = composeIndex(ix+1, iy, iz);
-            if ((d_map_[idxp] >= d_map_[idx] && d_map_[idxn] >= d_map_[idx]) || 
-                (d_map_[idxp] <= d_map_[idx] && d_map_[idxn] <= d_map_[idx])) {
-                dd_map_[idx].dx_ = 0.0;
+        for (int level = 0; level < static_cast<int >(buckets.size()); level++) {
+            while (static_cast<int >(level_distance.size()) <= level + 1) {
+                level_distance.push_back(level_distance.back() + voxel_size_);
             }
-            else if (d_map_[idxp] >= d_map_[idx]) {
-                dd_map_[idx].dx_ = 1.0;
-            }
-            else {
-                dd_map_[idx].dx_ = -1.0;
+            for (size_t i = 0; i < buckets[level].size(); i++) {
+                int idx = buckets[level][i];
+                if (getDistanceLevel(distances.get(idx), voxel_size_) != level) {
+                    // lowered after it was queued
+                    continue;
+                }
+                int ix, iy, iz;
+                decomposeIndex(idx, ix, iy, iz);
+                const bool valid[6] = {ix > 0, ix < steps_[0]-1, iy > 0, iy < steps_[1]-1, iz > 0, iz < steps_[2]-1};
+                for (int j = 0; j < 6; j++) {
+                    if (!valid[j]) {
+                        continue;
+                    }
+                    int n_idx = composeIndex(ix + dx[j], iy + dy[j], iz + dz[j]);
+                    if (n_idx != origin_idx && isOccupied(occupancy_, ((ix + dx[j]) * steps_[1] + iy + dy[j]) * steps_[2] + iz + dz[j])) {
+                        continue;
+                    }
+                    if ((flags_.get(n_idx) & VOXEL_VISITED) != 0 && getDistanceLevel(distances.get(n_idx), voxel_size_) <= level + 1) {
+                        continue;
+                    }
+                    if ((flags_.get(n_idx) & VOXEL_VISITED) == 0) {
+                        reached.push_back(n_idx);
+                    }
+                    distances.set(n_idx, level_distance[level + 1]);
+                    flags_.set(n_idx, flags_.get(n_idx) | VOXEL_VISITED);
+                    parents_.set(n_idx, encodeDirection(-dx[j], -dy[j], -dz[j]));
+                    if (level + 1 >= static_cast<int >(buckets.size())) {
+                        buckets.resize(level + 2);
+                    }
+                    buckets[level + 1].push_back(n_idx);
+                    changed.push_back(n_idx);
+                }
             }
+        }
 
-            idxp = composeIndex(ix, iy-1, iz);
-            idxn = composeIndex(ix, iy+1, iz);
-            if ((d_map_[idxp] >= d_map_[idx] && d_map_[idxn] >= d_map_[idx]) || 
-                (d_map_[idxp] <= d_map_[idx] && d_map_[idxn] <= d_map_[idx])) {
-                dd_map_[idx].dy_ = 0.0;
+        // the obstacle flags: the occupied voxels next to the reached voxels; they change only
+        // around the voxels that were toggled, raised or reached. The unfilled voxels keep -2
+        // for obstacles, as in growDistance.
+        std::vector<int > state_changed(toggled);
+        state_changed.insert(state_changed.end(), raised.begin(), raised.end());
+        state_changed.insert(state_changed.end(), reached.begin(), reached.end());
+        std::vector<int > flag_voxels;
+        std::vector<int > unfilled;
+        for (size_t i = 0; i < state_changed.size(); i++) {
+            int ix, iy, iz;
+            decomposeIndex(state_changed[i], ix, iy, iz);
+            const bool valid[6] = {ix > 0, ix < steps_[0]-1, iy > 0, iy < steps_[1]-1, iz > 0, iz < steps_[2]-1};
+            flag_voxels.push_back(state_changed[i]);
+            for (int j = 0; j < 6; j++) {
+                if (valid[j]) {
+                    flag_voxels.push_back(composeIndex(ix + dx[j], iy + dy[j], iz + dz[j]));
+                }
             }
-            else if (d_map_[idxp] >= d_map_[idx]) {
-                dd_map_[idx].dy_ = 1.0;
+        }
+        std::sort(flag_voxels.begin(), flag_voxels.end());
+        flag_voxels.erase(std::unique(flag_voxels.begin(), flag_voxels.end()), flag_voxels.end());
+        for (size_t i = 0; i < flag_voxels.size(); i++) {
+            int idx = flag_voxels[i];
+            int ix, iy, iz;
+            decomposeIndex(idx, ix, iy, iz);
+            bool obstacle = false;
+            if ((flags_.get(idx) & VOXEL_VISITED) == 0 && idx != origin_idx && isOccupied(occupancy_, (ix * steps_[1] + iy) * steps_[2] + iz)) {
+                const bool valid[6] = {ix > 0, ix < steps_[0]-1, iy > 0, iy < steps_[1]-1, iz > 0, iz < steps_[2]-1};
+                for (int j = 0; j < 6 && !obstacle; j++) {
+                    obstacle = valid[j] && (flags_.get(composeIndex(ix + dx[j], iy + dy[j], iz + dz[j])) & VOXEL_VISITED) != 0;
+                }
             }
-            else {
-                dd_map_[idx].dy_ = -1.0;
+            unsigned char flags = (flags_.get(idx) & ~VOXEL_OBSTACLE) | (obstacle ? VOXEL_OBSTACLE : 0);
+            if (flags != flags_.get(idx)) {
+                flags_.set(idx, flags);
+                if (distances.get(idx) < 0.0) {
+                    distances.set(idx, (obstacle ? -2.0 : -1.0));
+                    unfilled.push_back(idx);
+                }
             }
+        }
 
-            idxp = composeIndex(ix, iy, iz-1);
-            idxn = composeIndex(ix, iy, iz+1);
-            if ((d_map_[idxp] >= d_map_[idx] && d_map_[idxn] >= d_map_[idx]) || 
-                (d_map_[idxp] <= d_map_[idx] && d_map_[idxn] <= d_map_[idx])) {
-                dd_map_[idx].dz_ = 0.0;
-            }
-            else if (d_map_[idxp] >= d_map_[idx]) {
-                dd_map_[idx].dz_ = 1.0;
-            }
-            else {
-                dd_map_[idx].dz_ = -1.0;
+        // The interior of the obstacles depends only on the reached voxels next to it, in the neighbourhood
+        // of fillObstacleDistance, so the unreached voxels connected to the voxels with a changed
+        // distance are filled again; the other toggled voxels do not change it.
+        boost::unordered_set<int > in_region;
+        std::vector<int > region;
+        for (size_t i = 0; i < changed.size(); i++) {
+            int idx = changed[i];
+            if ((flags_.get(idx) & VOXEL_VISITED) == 0) {
+                if (in_region.insert(idx).second) {
+                    region.push_back(idx);
+                }
+                continue;
             }
-*/
-            bool found = false;
-            // we are in the obstacle, get the smallest distance in the neighbouring cells
-            for (int iix = std::max(0,ix-1); iix < std::min(steps_[0], ix+2) && !found; iix++) {
-                for (int iiy = std::max(0,iy-1); iiy < std::min(steps_[1], iy+2) && !found; iiy++) {
-                    for (int iiz = std::max(0,iz-1); iiz < std::min(steps_[2], iz+2) && !found; iiz++) {
+            int ix, iy, iz;
+            decomposeIndex(idx, ix, iy, iz);
+            for (int iix = std::max(0,ix-1); iix < std::min(steps_[0], ix+2); iix++) {
+                for (int iiy = std::max(0,iy-1); iiy < std::min(steps_[1], iy+2); iiy++) {
+                    if (ix == iix || iy == iiy) {
+                        continue;
+                    }
+                    for (int iiz = std::max(0,iz-1); iiz < std::min(steps_[2], iz+2); iiz++) {
                         int pt_idx = composeIndex(iix, iiy, iiz);
-                        double pt_val = d_map_[pt_idx];
-                        if (pt_val < 0.0) {
-                            bounduary_set_.insert(idx);
-                            found = true;
+                        if ((flags_.get(pt_idx) & VOXEL_VISITED) == 0 && in_region.insert(pt_idx).second) {
+                            region.push_back(pt_idx);
                         }
                     }
                 }
             }
         }
-//        std::cout << "bounduary_set_.size() " << bounduary_set_.size() << std::endl;
-/*
-        // increase the value for the bounduary points
-        // THIS DOES NOT WORK!
-        for (std::set<int >::const_iterator it = bounduary_set_.begin(); it != bounduary_set_.end(); it++) {
-            int idx = (*it);
-//            d_map_[idx] = -1;
-//            continue;
-            // get the highest value of non-bounduary neighbours
-            double min_value = d_map_[idx];
+        for (size_t i = 0; i < region.size(); i++) {
+            int ix, iy, iz;
+            decomposeIndex(region[i], ix, iy, iz);
             for (int iix = std::max(0,ix-1); iix < std::min(steps_[0], ix+2); iix++) {
                 for (int iiy = std::max(0,iy-1); iiy < std::min(steps_[1], iy+2); iiy++) {
+                    if (ix == iix || iy == iiy) {
+                        continue;
+                    }
                     for (int iiz = std::max(0,iz-1); iiz < std::min(steps_[2], iz+2); iiz++) {
                         int pt_idx = composeIndex(iix, iiy, iiz);
-                        double pt_val = d_map_[pt_idx];
-                        if (pt_val >= 0.0 && pt_val < min_value && bounduary_set_.find(pt_idx) == bounduary_set_.end()) {
-                            min_value = d_map_[pt_idx];
+                        if ((flags_.get(pt_idx) & VOXEL_VISITED) != 0) {
+                            // the encoded distances are rounded, so the reached voxels around
+                            // the region get back the sums of growDistance
+                            int level = getDistanceLevel(distances.get(pt_idx), voxel_size_);
+                            while (static_cast<int >(level_distance.size()) <= level) {
+                                level_distance.push_back(level_distance.back() + voxel_size_);
+                            }
+                            distances.set(pt_idx, level_distance[level]);
+                        }
+                        else if (in_region.insert(pt_idx).second) {
+                            region.push_back(pt_idx);
                         }
                     }
                 }
             }
-            min_value += voxel_size_;
-            d_map_[idx] = min_value;
         }
-//*/
-        return true;
+        std::vector<double > region_distance(region.size());
+        for (size_t i = 0; i < region.size(); i++) {
+            region_distance[i] = distances.get(region[i]);
+            distances.set(region[i], ((flags_.get(region[i]) & VOXEL_OBSTACLE) != 0 ? -2.0 : -1.0));
+            parents_.set(region[i], NO_PARENT);
+        }
+        std::vector<int > candidates(region);
+        fillObstacleDistance(distances, candidates);
+        for (size_t i = 0; i < region.size(); i++) {
+            if (distances.get(region[i]) != region_distance[i]) {
+                changed.push_back(region[i]);
+            }
+        }
+        changed.insert(changed.end(), unfilled.begin(), unfilled.end());
+        distances.flush();
+    }
+
+    // updates the gradient field and the tricubic coefficients that depend on the changed voxels
+    void ReachabilityMap::updateDistanceDerivatives(const std::vector<int > &changed) {
+        if (!descent_.empty()) {
+            // the descent direction of a voxel depends on its 26 neighbours
+            std::vector<int > voxels;
+            for (size_t i = 0; i < changed.size(); i++) {
+                int ix, iy, iz;
+                decomposeIndex(changed[i], ix, iy, iz);
+                for (int iix = std::max(0,ix-1); iix < std::min(steps_[0], ix+2); iix++) {
+                    for (int iiy = std::max(0,iy-1); iiy < std::min(steps_[1], iy+2); iiy++) {
+                        for (int iiz = std::max(0,iz-1); iiz < std::min(steps_[2], iz+2); iiz++) {
+                            voxels.push_back(composeIndex(iix, iiy, iiz));
+                        }
+                    }
+                }
+            }
+            std::sort(voxels.begin(), voxels.end());
+            voxels.erase(std::unique(voxels.begin(), voxels.end()), voxels.end());
+            for (size_t i = 0; i < voxels.size(); i++) {
+                descent_.set(voxels[i], scanDescent(voxels[i]));
+            }
+        }
+
+        if (!coeff_cache_) {
+            return;
+        }
+        if (coeff_cache_type_ != COEFF_CACHE_PRECOMPUTED) {
+            // the lazy cache is filled again by the queries
+            resetCoefficientCache();
+            return;
+        }
+        // the coefficients of the cell (ix, iy, iz) depend on the voxels ix-1 .. ix+2 (and the same in y and z)
+        std::vector<int > cells;
+        for (size_t i = 0; i < changed.size(); i++) {
+            int ix, iy, iz;
+            decomposeIndex(changed[i], ix, iy, iz);
+            for (int iix = std::max(1,ix-2); iix < std::min(steps_[0]-3, ix+2); iix++) {
+                for (int iiy = std::max(1,iy-2); iiy < std::min(steps_[1]-3, iy+2); iiy++) {
+                    for (int iiz = std::max(1,iz-2); iiz < std::min(steps_[2]-3, iz+2); iiz++) {
+                        cells.push_back(composeIndex(iix, iiy, iiz));
+                    }
+                }
+            }
+        }
+        std::sort(cells.begin(), cells.end());
+        cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+        for (size_t i = 0; i < cells.size(); i++) {
+            int ix, iy, iz;
+            decomposeIndex(cells[i], ix, iy, iz);
+            tricubic_get_coeff(&coeff_cache_->precomputed_[static_cast<size_t >(cells[i]) * 64], ix, iy, iz);
+        }
     }
+
 /*
     bool ReachabilityMap::getDistnace(const KDL::Vector &x, double &distance) const {
         int idx = getIndex(x);
@@ -1057,32 +2357,13 @@ fptype ReachabilityMap::ip(list xyz){
 */
 
     bool ReachabilityMap::getDistance(const KDL::Vector &x, double &distance) const {
+        return getDistance<InterpolationTricubic >(x, distance);
+    }
 
-        int ix0 = std::floor((x.x() - ep_min_(0)) / voxel_size_);
-        int iy0 = std::floor((x.y() - ep_min_(1)) / voxel_size_);
-        int iz0 = std::floor((x.z() - ep_min_(2)) / voxel_size_);
-        int ix1 = ix0+1;
-        int iy1 = iy0+1;
-        int iz1 = iz0+1;
-
-        if (ix0 < 1 || iy0 < 1 || iz0 < 1 || ix1 >= steps_[0]-2 || iy1 >= steps_[1]-2 || iz1 >= steps_[2]-2) {
-            return false;
-        }
-
-        double x0 = ep_min_(0) + ix0 * voxel_size_;
-        double y0 = ep_min_(1) + iy0 * voxel_size_;
-        double z0 = ep_min_(2) + iz0 * voxel_size_;
-        double x1 = ep_min_(0) + ix1 * voxel_size_;
-        double y1 = ep_min_(1) + iy1 * voxel_size_;
-        double z1 = ep_min_(2) + iz1 * voxel_size_;
-
+    double ReachabilityMap::getTricubicDistance(int ix, int iy, int iz, double u, double v, double w) const {
         double a[64];
-
-        tricubic_get_coeff(a, ix0, iy0, iz0);
-
-        distance = tricubic_eval(a, (x.x() - x0) / voxel_size_, (x.y() - y0) / voxel_size_, (x.z() - z0) / voxel_size_, 0, 0, 0)/ voxel_size_;
-
-        return true;
+        getCoefficients(a, ix, iy, iz);
+        return tricubic_eval_value(a, u, v, w);
     }
 
     bool ReachabilityMap::collisionFreeLine(int ix1, int iy1, int iz1, int ix2, int iy2, int iz2) const {
@@ -1115,74 +2396,181 @@ fptype ReachabilityMap::ip(list xyz){
                 return false;
             }
         }
-        return true;
+        return true;
+    }
+
+    bool ReachabilityMap::getGradient(int idx, KDL::Vector &gradient) const {
+        unsigned char dir = (descent_.empty() ? scanDescent(idx) : descent_.get(idx));
+        if (dir == NO_PARENT) {
+            return false;
+        }
+        gradient = KDL::Vector(dir / 9 - 1, (dir / 3) % 3 - 1, dir % 3 - 1);
+        gradient.Normalize();
+        return true;
+    }
+
+    int ReachabilityMap::getFlags(int idx) const {
+        return flags_.empty() ? 0 : flags_.get(idx);
+    }
+
+    int ReachabilityMap::getVoxelFlags(const KDL::Vector &x) const {
+        int idx = getIndex(x);
+        if (idx < 0 || d_map_.empty()) {
+            return -1;
+        }
+        return getFlags(idx);
+    }
+
+    int ReachabilityMap::getPaths(const std::vector<KDL::Vector > &starts, std::vector<std::vector<KDL::Vector > > &paths, int threads_count) const {
+        int count = starts.size();
+        paths.resize(count);
+        threads_count = std::max(1, std::min(threads_count, count));
+        std::vector<int > found_count(threads_count, 0);
+        if (threads_count == 1) {
+            getPathsRange(starts, paths, 0, count, &found_count[0]);
+        }
+        else {
+            boost::thread_group threads;
+            for (int t = 0; t < threads_count; t++) {
+                int begin = count * t / threads_count;
+                int end = count * (t + 1) / threads_count;
+                threads.create_thread( boost::bind(&ReachabilityMap::getPathsRange, this, boost::cref(starts), boost::ref(paths), begin, end, &found_count[t]) );
+            }
+            threads.join_all();
+        }
+
+        int result = 0;
+        for (int t = 0; t < threads_count; t++) {
+            result += found_count[t];
+        }
+        return result;
+    }
+
+    void ReachabilityMap::getPathsRange(const std::vector<KDL::Vector > &starts, std::vector<std::vector<KDL::Vector > > &paths, int begin, int end, int *found_count) const {
+        *found_count = 0;
+        int origin_idx = (parents_.empty() ? -1 : getIndex(origin_));
+        for (int i = begin; i < end; i++) {
+            paths[i].clear();
+            int idx = getIndex(starts[i]);
+            if (idx < 0 || origin_idx < 0) {
+                continue;
+            }
+            int ix, iy, iz;
+            decomposeIndex(idx, ix, iy, iz);
+            // the distance decreases along the parents, so a path visits each voxel once
+            for (size_t step = 0; step < parents_.size(); step++) {
+                KDL::Vector pt;
+                getIndexCenter(ix, iy, iz, pt);
+                paths[i].push_back(pt);
+                if (idx == origin_idx) {
+                    (*found_count)++;
+                    break;
+                }
+                unsigned char dir = parents_.get(idx);
+                if (dir == NO_PARENT) {
+                    break;
+                }
+                ix += dir / 9 - 1;
+                iy += (dir / 3) % 3 - 1;
+                iz += dir % 3 - 1;
+                idx = composeIndex(ix, iy, iz);
+            }
+            if (idx != origin_idx) {
+                paths[i].clear();
+            }
+        }
+    }
+
+    bool ReachabilityMap::getVoxelGradient(const KDL::Vector &x, KDL::Vector &gradient) const {
+        int idx = getIndex(x);
+        if (idx < 0 || d_map_.empty()) {
+            return false;
+        }
+        return getGradient(idx, gradient);
+    }
+
+    void ReachabilityMap::createGradientField(int threads_count) {
+        descent_.reset(layout_steps_, 1, NO_PARENT);
+        threads_count = std::max(1, std::min(threads_count, steps_[0]));
+        // the blocks of the sparse storage are allocated on write, so its threads
+        // collect the gradients and they are written afterwards
+        std::vector<std::vector<std::pair<int, unsigned char > > > gradients(threads_count);
+        if (threads_count == 1) {
+            computeGradientField(0, steps_[0], (descent_.isSparse() ? &gradients[0] : NULL));
+        }
+        else {
+            boost::thread_group threads;
+            for (int t = 0; t < threads_count; t++) {
+                int ix_begin = steps_[0] * t / threads_count;
+                int ix_end = steps_[0] * (t + 1) / threads_count;
+                threads.create_thread( boost::bind(&ReachabilityMap::computeGradientField, this, ix_begin, ix_end, (descent_.isSparse() ? &gradients[t] : NULL)) );
+            }
+            threads.join_all();
+        }
+        for (int t = 0; t < threads_count; t++) {
+            for (size_t i = 0; i < gradients[t].size(); i++) {
+                descent_.set(gradients[t][i].first, gradients[t][i].second);
+            }
+        }
+    }
+
+    // the descent directions of the slab [ix_begin, ix_end) of the map
+    void ReachabilityMap::computeGradientField(int ix_begin, int ix_end, std::vector<std::pair<int, unsigned char > > *gradients) {
+        for (int ix = ix_begin; ix < ix_end; ix++) {
+            for (int iy = 0; iy < steps_[1]; iy++) {
+                for (int iz = 0; iz < steps_[2]; iz++) {
+                    int idx = composeIndex(ix, iy, iz);
+                    unsigned char dir = scanDescent(idx);
+                    if (dir == NO_PARENT) {
+                        continue;
+                    }
+                    if (gradients == NULL) {
+                        descent_.set(idx, dir);
+                    }
+                    else {
+                        gradients->push_back( std::make_pair(idx, dir) );
+                    }
+                }
+            }
+        }
     }
 
-    bool ReachabilityMap::getGradient(int idx, KDL::Vector &gradient) const {
+    // the direction to the neighbour (of 26) with the smallest distance, coded as the parent
+    // directions, or NO_PARENT inside obstacles and at the minima
+    unsigned char ReachabilityMap::scanDescent(int idx) const {
         double min_value = d_map_[idx];
+        if (min_value < 0.0) {
+            // we are in the obstacle
+            return NO_PARENT;
+        }
 
-//        int ix = getIndexDim(x.x(), 0);
-//        int iy = getIndexDim(x.y(), 1);
-//        int iz = getIndexDim(x.z(), 2);
         int ix, iy, iz;
         decomposeIndex(idx, ix, iy, iz);
 
-        bool obstacle = false;
         int search_space = 1;
-        if (min_value < 0.0) {
-            // we are in the obstacle
-            min_value = 100000.0;
-            obstacle = true;
-//            std::cout << "obst. " << pt[0] << " " << pt[1] << " " << pt[2] << " " << d_map_[idx] << std::endl;
-            return false;
-//            std::cout << "obstacle" << std::endl;
-        }
-//        int min_ix=-1, min_iy=-1, min_iz=-1;
-        KDL::Vector min_vec;
-        bool found = false;
+        unsigned char min_dir = NO_PARENT;
         for (int iix = std::max(0,ix-search_space); iix < std::min(steps_[0], ix+search_space+1); iix++) {
             for (int iiy = std::max(0,iy-search_space); iiy < std::min(steps_[1], iy+search_space+1); iiy++) {
                 for (int iiz = std::max(0,iz-search_space); iiz < std::min(steps_[2], iz+search_space+1); iiz++) {
                     if (ix == iix && iy == iiy && iz == iiz) {
                         continue;
                     }
-                    int pt_idx = composeIndex(iix, iiy, iiz);
-                    double pt_val = d_map_[pt_idx];
+                    double pt_val = d_map_[composeIndex(iix, iiy, iiz)];
                     if (pt_val >= 0.0 && min_value > pt_val) {
-//                    if (pt_val >= 0.0 && (obstacle || collisionFreeLine(x, iix, iiy, iiz)) && min_value > pt_val) {
-//                    if (pt_val >= 0.0 && bounduary_set_.find(pt_idx) == bounduary_set_.end() && min_value > pt_val) {
                         min_value = pt_val;
-                        min_vec = KDL::Vector(iix - ix, iiy - iy, iiz - iz);
-                        found = true;
-//                            min_ix = iix;
-//                            min_iy = iiy;
-//                            min_iz = iiz;
+                        min_dir = encodeDirection(iix - ix, iiy - iy, iiz - iz);
                     }
                 }
             }
         }
 
-        if (!found) {// min_ix == -1) {
-//            std::cout << "ReachabilityMap::getGradient: could not find gradient, min_value: " << min_value << std::endl;
-//            std::cout << "no min " << pt[0] << " " << pt[1] << " " << pt[2] << " " << d_map_[idx] << std::endl;
-            return false;
-        }
-        min_vec.Normalize();
-        gradient = min_vec;
-        return true;
-/*
-        KDL::Vector min_pt;
-        KDL::Vector pt;
-        getIndexCenter(ix, iy, iz, pt);
-        getIndexCenter(min_ix, min_iy, min_iz, min_pt);
-//        std::cout << " ok " << pt[0] << " " << pt[1] << " " << pt[2] << " " << d_map_[idx] << " to " << min_pt[0] << " " << min_pt[1] << " " << min_pt[2] << " " << min_value << std::endl;
-        gradient = min_pt - pt;
-        gradient.Normalize();
-*/
-        return true;
+        return min_dir;
     }
 
     bool ReachabilityMap::getGradient(const KDL::Vector &x, KDL::Vector &gradient) const {
+        if (d_map_.empty()) {
+            return false;
+        }
 
         int ix0 = std::floor((x.x() - ep_min_(0)) / voxel_size_);
         int iy0 = std::floor((x.y() - ep_min_(1)) / voxel_size_);
@@ -1204,18 +2592,136 @@ fptype ReachabilityMap::ip(list xyz){
 
         double a[64];
 
-        tricubic_get_coeff(a, ix0, iy0, iz0);
+        getCoefficients(a, ix0, iy0, iz0);
 
-        double dx, dy, dz;
-        dx = tricubic_eval(a, (x.x() - x0) / voxel_size_, (x.y() - y0) / voxel_size_, (x.z() - z0) / voxel_size_, 1, 0, 0)/ voxel_size_;
-        dy = tricubic_eval(a, (x.x() - x0) / voxel_size_, (x.y() - y0) / voxel_size_, (x.z() - z0) / voxel_size_, 0, 1, 0)/ voxel_size_;
-        dz = tricubic_eval(a, (x.x() - x0) / voxel_size_, (x.y() - y0) / voxel_size_, (x.z() - z0) / voxel_size_, 0, 0, 1)/ voxel_size_;
-        gradient = -KDL::Vector(dx, dy, dz);
+        double df[3];
+        tricubic_eval_gradient(a, (x.x() - x0) / voxel_size_, (x.y() - y0) / voxel_size_, (x.z() - z0) / voxel_size_, NULL, df);
+        gradient = -KDL::Vector(df[0], df[1], df[2]) / voxel_size_;
         gradient.Normalize();
 
         return true;
     }
 
+    bool ReachabilityMap::getDistance(const KDL::Vector &x, double &distance, KDL::Vector &gradient, Eigen::Matrix3d *hessian) const {
+        if (d_map_.empty()) {
+            return false;
+        }
+
+        int ix0 = std::floor((x.x() - ep_min_(0)) / voxel_size_);
+        int iy0 = std::floor((x.y() - ep_min_(1)) / voxel_size_);
+        int iz0 = std::floor((x.z() - ep_min_(2)) / voxel_size_);
+
+        if (ix0 < 1 || iy0 < 1 || iz0 < 1 || ix0 >= steps_[0]-3 || iy0 >= steps_[1]-3 || iz0 >= steps_[2]-3) {
+            return false;
+        }
+
+        double a[64];
+        getCoefficients(a, ix0, iy0, iz0);
+
+        // the polynomial is defined over the cell scaled to the unit cube
+        double f, df[3], ddf[6];
+        double u = (x.x() - ep_min_(0)) / voxel_size_ - ix0;
+        double v = (x.y() - ep_min_(1)) / voxel_size_ - iy0;
+        double w = (x.z() - ep_min_(2)) / voxel_size_ - iz0;
+        if (hessian == NULL) {
+            tricubic_eval_gradient(a, u, v, w, &f, df);
+        }
+        else {
+            tricubic_eval_derivatives(a, u, v, w, &f, df, ddf);
+        }
+
+        distance = f / voxel_size_;
+        double scale = 1.0 / (voxel_size_ * voxel_size_);
+        gradient = KDL::Vector(df[0], df[1], df[2]) * scale;
+        if (hessian != NULL) {
+            scale /= voxel_size_;
+            (*hessian) << ddf[0], ddf[3], ddf[4],
+                          ddf[3], ddf[1], ddf[5],
+                          ddf[4], ddf[5], ddf[2];
+            (*hessian) *= scale;
+        }
+
+        return true;
+    }
+
+    class ReachabilityMap::DistanceBatch {
+    public:
+        const double *x_, *y_, *z_;
+        double *distance_;
+        double *gx_, *gy_, *gz_;
+        unsigned char *valid_;
+    };
+
+    // each point is evaluated with the Horner kernel of the scalar query, straight from its
+    // coefficients; transposing them into lanes of points costs more than the lanes save
+    void ReachabilityMap::getDistancesRange(const DistanceBatch &batch, int begin, int end, int *valid_count) const {
+        double scale = 1.0 / (voxel_size_ * voxel_size_);
+        int count = 0;
+        for (int i = begin; i < end; i++) {
+            double cx = (batch.x_[i] - ep_min_(0)) / voxel_size_;
+            double cy = (batch.y_[i] - ep_min_(1)) / voxel_size_;
+            double cz = (batch.z_[i] - ep_min_(2)) / voxel_size_;
+            int ix0 = std::floor(cx);
+            int iy0 = std::floor(cy);
+            int iz0 = std::floor(cz);
+            if (ix0 < 1 || iy0 < 1 || iz0 < 1 || ix0 >= steps_[0]-3 || iy0 >= steps_[1]-3 || iz0 >= steps_[2]-3) {
+                batch.valid_[i] = 0;
+                continue;
+            }
+            batch.valid_[i] = 1;
+            count++;
+            double coeff_buf[64];
+            const double *coeff = getPrecomputedCoefficients(ix0, iy0, iz0);
+            if (coeff == NULL) {
+                getCoefficients(coeff_buf, ix0, iy0, iz0);
+                coeff = coeff_buf;
+            }
+            double f, df[3];
+            if (batch.gx_ != NULL) {
+                tricubic_eval_gradient(coeff, cx - ix0, cy - iy0, cz - iz0, &f, df);
+                batch.gx_[i] = df[0] * scale;
+                batch.gy_[i] = df[1] * scale;
+                batch.gz_[i] = df[2] * scale;
+            }
+            else {
+                f = tricubic_eval_value(coeff, cx - ix0, cy - iy0, cz - iz0);
+            }
+            batch.distance_[i] = f / voxel_size_;
+        }
+        *valid_count = count;
+    }
+
+    int ReachabilityMap::getDistances(int count, const double *x, const double *y, const double *z, double *distance, double *gx, double *gy, double *gz, unsigned char *valid, int threads_count) const {
+        if (d_map_.empty() || steps_.size() != 3) {
+            for (int i = 0; i < count; i++) {
+                valid[i] = 0;
+            }
+            return 0;
+        }
+
+        DistanceBatch batch = {x, y, z, distance, (gy == NULL || gz == NULL) ? NULL : gx, gy, gz, valid};
+        threads_count = std::max(1, std::min(threads_count, count));
+        std::vector<int > valid_count(threads_count, 0);
+        if (threads_count == 1) {
+            getDistancesRange(batch, 0, count, &valid_count[0]);
+        }
+        else {
+            boost::thread_group threads;
+            for (int t = 0; t < threads_count; t++) {
+                int begin = static_cast<int >( static_cast<long long >(count) * t / threads_count );
+                int end = static_cast<int >( static_cast<long long >(count) * (t + 1) / threads_count );
+                threads.create_thread( boost::bind(&ReachabilityMap::getDistancesRange, this, boost::cref(batch), begin, end, &valid_count[t]) );
+            }
+            threads.join_all();
+        }
+
+        int result = 0;
+        for (int t = 0; t < threads_count; t++) {
+            result += valid_count[t];
+        }
+        return result;
+    }
+
     bool ReachabilityMap::getAllGradients(const KDL::Vector &x, std::vector<ReachabilityMap::GradientInfo > &gradients) const {
         if (gradients.size() != 27) {
             std::cout << "ReachabilityMap::getAllGradients: wrong vector size: " << gradients.size() << std::endl;
@@ -1227,21 +2733,12 @@ fptype ReachabilityMap::ip(list xyz){
         }
 
         int idx = getIndex(x);
-        if (idx < 0) {
+        if (idx < 0 || d_map_.empty()) {
 //            std::cout << "ReachabilityMap::getGradient: point is outside the map" << std::endl;
             return false;
         }
 
-        bool isBounduary = bounduary_set_.find(idx) != bounduary_set_.end();
-
-        double min_value = d_map_[idx];
-        bool obstacle = false;
         int search_space = 1;
-        if (min_value < 0.0) {
-//            // we are in the obstacle
-//            min_value = 100000.0;
-            obstacle = true;
-        }
 //        int min_ix=-1, min_iy=-1, min_iz=-1;
         int ix = getIndexDim(x.x(), 0);
         int iy = getIndexDim(x.y(), 1);
@@ -1261,13 +2758,7 @@ fptype ReachabilityMap::ip(list xyz){
                     int pt_idx = composeIndex(iix, iiy, iiz);
                     double pt_val = d_map_[pt_idx];
 
-                    if (obstacle && bounduary_set_.find(pt_idx) != bounduary_set_.end()) {
-                        gradients[gradient_idx].direction_ = KDL::Vector(iix - ix, iiy - iy, iiz - iz);
-                        gradients[gradient_idx].direction_.Normalize();
-                        gradients[gradient_idx].value_ = pt_val;// - d_map_[idx];
-                        gradients[gradient_idx].valid_ = true;
-                    }
-                    else if (pt_val >= 0.0 && bounduary_set_.find(pt_idx) == bounduary_set_.end()) {
+                    if (pt_val >= 0.0) {
                         gradients[gradient_idx].direction_ = KDL::Vector(iix - ix, iiy - iy, iiz - iz);
                         gradients[gradient_idx].direction_.Normalize();
                         gradients[gradient_idx].value_ = pt_val;// - d_map_[idx];
@@ -1320,65 +2811,77 @@ fptype ReachabilityMap::ip(list xyz){
 */
     }
 
-    void ReachabilityMap::grow() {
-        std::vector<int > map_copy(r_map_);
-        for (int idx = 0; idx < map_copy.size(); idx++) {
-            if (map_copy[idx] > 1) {
-                map_copy[idx] = 1;
-            }
+    // 1-D Manhattan distance transform along the axis of the row-major grid, in place: a forward
+    // and a backward pass. The grid is seen as [outer][n][inner] with n = steps[axis], and the
+    // columns [column_begin, column_end) of the outer * inner columns are transformed; the
+    // passes step over the contiguous inner elements, so they are vectorized
+    static void manhattanDistanceColumns(int *grid, const std::vector<int > &steps, int axis, int column_begin, int column_end) {
+        int n = steps[axis];
+        int inner = 1;
+        for (int dim_idx = axis + 1; dim_idx < static_cast<int >(steps.size()); dim_idx++) {
+            inner *= steps[dim_idx];
         }
 
-        std::vector<int > d(dim_);
-
-        if (dim_ == 2) {
-            for (int d0=0; d0<steps_[0]; d0++) {
-                for (int d1=0; d1<steps_[1]; d1++) {
-                    int idx = d0 * steps_[1] + d1;
-                    if (map_copy[idx] == 1) {
-                        d[0] = d0;
-                        d[1] = d1;
-                        std::list<int > n_indices;
-                        getNeighbourIndices(d, n_indices);
-                        for (std::list<int >::const_iterator it = n_indices.begin(); it != n_indices.end(); it++) {
-                            if (map_copy[(*it)] == 0) {
-                                map_copy[(*it)] = 2;
-                            }
-                        }
-                    }
+        for (int o = column_begin / inner; o * inner < column_end; o++) {
+            int i_begin = std::max(column_begin - o * inner, 0);
+            int i_end = std::min(column_end - o * inner, inner);
+            int *d = grid + static_cast<size_t >(o) * n * inner;
+            for (int q = 1; q < n; q++) {
+                int *cur = d + q * inner;
+                const int *prev = cur - inner;
+                for (int i = i_begin; i < i_end; i++) {
+                    cur[i] = std::min(cur[i], prev[i] + 1);
                 }
             }
-        }
-        else if (dim_ == 3) {
-            for (int d0=0; d0<steps_[0]; d0++) {
-                for (int d1=0; d1<steps_[1]; d1++) {
-                    for (int d2=0; d2<steps_[2]; d2++) {
-                        int idx = (d0 * steps_[1] + d1) * steps_[2] + d2;
-                        if (map_copy[idx] == 1) {
-                            d[0] = d0;
-                            d[1] = d1;
-                            d[2] = d2;
-                            std::list<int > n_indices;
-                            getNeighbourIndices(d, n_indices);
-                            for (std::list<int >::const_iterator it = n_indices.begin(); it != n_indices.end(); it++) {
-                                if (map_copy[(*it)] == 0) {
-                                    map_copy[(*it)] = 2;
-                                }
-                            }
-                        }
-                    }
+            for (int q = n - 2; q >= 0; q--) {
+                int *cur = d + q * inner;
+                const int *next = cur + inner;
+                for (int i = i_begin; i < i_end; i++) {
+                    cur[i] = std::min(cur[i], next[i] + 1);
                 }
             }
         }
-        else {
-            std::cout << "ReachabilityMap::grow not implemented for " << dim_ << " dimensions" << std::endl;
+    }
+
+    void ReachabilityMap::grow() {
+        grow(1, 1);
+    }
+
+    // k calls of grow() dilate the reachable voxels by one voxel (6-neighbourhood) each, so the voxel
+    // at the Manhattan distance d gets one for every call from max(d, 1) to k; the distance is
+    // separable, so it is computed axis by axis, saturated at voxels + 1
+    void ReachabilityMap::grow(int voxels, int threads_count) {
+        if (voxels <= 0 || r_map_.empty()) {
             return;
         }
+        int map_size = r_map_.size();
+        std::vector<int > dist(map_size);
+        for (int idx = 0; idx < map_size; idx++) {
+            dist[idx] = (r_map_.get(idx) > 0 ? 0 : voxels + 1);
+        }
+
+        for (int axis = 0; axis < dim_; axis++) {
+            int columns_count = map_size / steps_[axis];
+            int threads = std::max(1, std::min(threads_count, columns_count));
+            if (threads == 1) {
+                manhattanDistanceColumns(&dist[0], steps_, axis, 0, columns_count);
+                continue;
+            }
+            // the slabs of columns of the threads are disjoint
+            boost::thread_group thread_group;
+            for (int t = 0; t < threads; t++) {
+                int column_begin = static_cast<int >( static_cast<long long >(columns_count) * t / threads );
+                int column_end = static_cast<int >( static_cast<long long >(columns_count) * (t + 1) / threads );
+                thread_group.create_thread( boost::bind(&manhattanDistanceColumns, &dist[0], boost::cref(steps_), axis, column_begin, column_end) );
+            }
+            thread_group.join_all();
+        }
 
-        for (int idx = 0; idx < map_copy.size(); idx++) {
-            if (map_copy[idx] > 1) {
-                map_copy[idx] = 1;
+        for (int idx = 0; idx < map_size; idx++) {
+            if (dist[idx] > voxels) {
+                continue;
             }
-            r_map_[idx] += map_copy[idx];
+            r_map_[idx] += voxels - std::max(dist[idx], 1) + 1;
             if (r_map_[idx] > max_value_) {
                 max_value_ = r_map_[idx];
             }
@@ -1387,11 +2890,21 @@ fptype ReachabilityMap::ip(list xyz){
 
     void ReachabilityMap::addMap(const ReachabilityMap &map) {
         for (int idx = 0; idx < r_map_.size(); idx++) {
+            if (map.r_map_[idx] == 0) {
+                continue;
+            }
             r_map_[idx] += map.r_map_[idx];
             if (r_map_[idx] > max_value_) {
                 max_value_ = r_map_[idx];
             }
         }
+        if (map.r_map_rot_.size() == r_map_rot_.size()) {
+            for (size_t idx = 0; idx < r_map_rot_.size(); idx++) {
+                if (map.r_map_rot_[idx] != 0) {
+                    r_map_rot_.set(idx, r_map_rot_.get(idx) | map.r_map_rot_[idx]);
+                }
+            }
+        }
     }
 
     void ReachabilityMap::addMap(const boost::shared_ptr<ReachabilityMap > &pmap) {
@@ -1404,21 +2917,56 @@ fptype ReachabilityMap::ip(list xyz){
 
     void ReachabilityMap::addPenalty(const Eigen::VectorXd &x) {
         int idx = getIndex(x);
-        if (idx >= 0) {
+        if (idx >= 0 && !r_map_.empty()) {
+            // the penalty map is allocated on the first use, and it is not stored in the map file
+            if (p_map_.empty()) {
+                p_map_.reset(steps_, 1, 0);
+            }
             p_map_[idx] += max_value_;
         }
     }
 
     void ReachabilityMap::resetPenalty() {
-        for (int idx = 0; idx < p_map_.size(); idx++) {
-            p_map_[idx] = 0;
+        p_map_.fill(0);
+    }
+
+    void ReachabilityMap::setStorage(DistanceStorage::Encoding distance_encoding, double distance_resolution, CounterStorage::Encoding counter_encoding) {
+        // the -1 and -2 markers of the unreached and obstacle voxels must stay apart
+        if (distance_encoding == DistanceStorage::ENCODING_FIXED16 && (distance_resolution <= 0.0
+                || DistanceStorage::roundFixed(-2.0, distance_resolution) >= DistanceStorage::roundFixed(-1.0, distance_resolution))) {
+            std::cout << "ERROR: ReachabilityMap::setStorage: wrong resolution of the distance: " << distance_resolution << std::endl;
+            return;
         }
+        distance_encoding_ = distance_encoding;
+        distance_resolution_ = distance_resolution;
+        d_map_.setEncoding(distance_encoding_, distance_resolution_);
+        r_map_.setEncoding(counter_encoding);
+        p_map_.setEncoding(counter_encoding);
+        max_value_ = 0;
+        for (size_t idx = 0; idx < r_map_.size(); idx++) {
+            max_value_ = std::max(max_value_, r_map_.get(idx));
+        }
+        resetCoefficientCache();
+    }
+
+    size_t ReachabilityMap::getMemoryUsage() const {
+        return r_map_.getMemoryUsage() + p_map_.getMemoryUsage() + r_map_rot_.getMemoryUsage() + d_map_.getMemoryUsage() + descent_.getMemoryUsage() + flags_.getMemoryUsage() + parents_.getMemoryUsage() + occupancy_.size() * sizeof(boost::uint64_t);
     }
 
     int ReachabilityMap::getIndex(const Eigen::VectorXd &x) const {
+        return getIndex(x.data());
+    }
+
+    int ReachabilityMap::getIndex(const double *x) const {
+        if (dim_ == 2) {
+            return getIndexFixed<2 >(x);
+        }
+        else if (dim_ == 3) {
+            return getIndexFixed<3 >(x);
+        }
         int total_idx = 0;
         for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
-            int idx = static_cast<int >( floor( (x(dim_idx) - ep_min_(dim_idx)) / voxel_size_ ) );
+            int idx = static_cast<int >( floor( (x[dim_idx] - ep_min_(dim_idx)) / voxel_size_ ) );
             if (idx < 0 || idx >= steps_[dim_idx]) {
                 return -1;
             }
@@ -1428,13 +2976,23 @@ fptype ReachabilityMap::ip(list xyz){
     }
 
     int ReachabilityMap::getIndex(const KDL::Vector &x) const {
+        int i[3];
         int total_idx = 0;
+        if (dim_ == 3) {
+            const double *ep_min = ep_min_.data();
+            bool inside = true;
+            for (int dim_idx = 0; dim_idx < 3; dim_idx++) {
+                i[dim_idx] = static_cast<int >( (x[dim_idx] - ep_min[dim_idx]) / voxel_size_ );
+                inside &= (i[dim_idx] >= 0) & (i[dim_idx] < steps_[dim_idx]);
+            }
+            return inside ? composeIndex(i[0], i[1], i[2]) : -1;
+        }
         for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
-            int idx = static_cast<int >( (x[dim_idx] - ep_min_(dim_idx)) / voxel_size_ );
-            if (idx < 0 || idx >= steps_[dim_idx]) {
+            i[dim_idx] = static_cast<int >( (x[dim_idx] - ep_min_(dim_idx)) / voxel_size_ );
+            if (i[dim_idx] < 0 || i[dim_idx] >= steps_[dim_idx]) {
                 return -1;
             }
-            total_idx = total_idx * steps_[dim_idx] + idx;
+            total_idx = total_idx * steps_[dim_idx] + i[dim_idx];
         }
         return total_idx;
     }
@@ -1447,20 +3005,56 @@ fptype ReachabilityMap::ip(list xyz){
         return idx;
     }
 
-    int ReachabilityMap::composeIndex(const Eigen::Vector3i &i) const {
-        return (i(0) * steps_[1] + i(1)) * steps_[2] + i(2);
+    // the offsets of the bricks and of the voxels in the bricks are separable, so the index
+    // is the sum of per-dimension offsets; the row-major layout is the brick of one voxel
+    void ReachabilityMap::updateLayout() {
+        layout_steps_ = steps_;
+        for (int dim_idx = 0; dim_idx < 3; dim_idx++) {
+            layout_offsets_[dim_idx].clear();
+        }
+        if (steps_.size() != 3) {
+            layout_bits_ = 0;
+            return;
+        }
+        layout_bits_ = (layout_ == LAYOUT_BRICKS && !sparse_) ? brick_bits_ : 0;
+        if (layout_bits_ == 0) {
+            return;
+        }
+        int brick_size = 1 << layout_bits_;
+        int brick_mult = 1 << (3 * layout_bits_);
+        int local_mult = 1;
+        for (int dim_idx = 2; dim_idx >= 0; dim_idx--) {
+            layout_steps_[dim_idx] = (steps_[dim_idx] + brick_size - 1) / brick_size * brick_size;
+            layout_offsets_[dim_idx].resize(layout_steps_[dim_idx]);
+            for (int i = 0; i < layout_steps_[dim_idx]; i++) {
+                layout_offsets_[dim_idx][i] = (i >> layout_bits_) * brick_mult + (i & (brick_size - 1)) * local_mult;
+            }
+            brick_mult *= layout_steps_[dim_idx] / brick_size;
+            local_mult *= brick_size;
+        }
     }
 
-    int ReachabilityMap::composeIndex(int ix, int iy, int iz) const {
-        return (ix * steps_[1] + iy) * steps_[2] + iz;
+    int ReachabilityMap::composeIndex(const Eigen::Vector3i &i) const {
+        return composeIndex(i(0), i(1), i(2));
     }
 
     void ReachabilityMap::decomposeIndex(int idx, int &ix, int &iy, int &iz) const {
-        iz = idx % steps_[2];
-        idx = (idx - iz) / steps_[2];
-        iy = idx % steps_[1];
-        idx = (idx - iy) / steps_[1];
-        ix = idx;
+        if (layout_bits_ == 0) {
+            iz = idx % steps_[2];
+            idx /= steps_[2];
+            iy = idx % steps_[1];
+            ix = idx / steps_[1];
+            return;
+        }
+        int mask = (1 << layout_bits_) - 1;
+        int local = idx & ((1 << (3 * layout_bits_)) - 1);
+        int brick = idx >> (3 * layout_bits_);
+        int bricks_z = layout_steps_[2] >> layout_bits_;
+        int bricks_y = layout_steps_[1] >> layout_bits_;
+        iz = ((brick % bricks_z) << layout_bits_) | (local & mask);
+        brick /= bricks_z;
+        iy = ((brick % bricks_y) << layout_bits_) | ((local >> layout_bits_) & mask);
+        ix = ((brick / bricks_y) << layout_bits_) | (local >> (2 * layout_bits_));
     }
 
     void ReachabilityMap::getIndexCenter(int ix, int iy, int iz, KDL::Vector &pt) const {
@@ -1473,12 +3067,382 @@ fptype ReachabilityMap::ip(list xyz){
 
     void ReachabilityMap::printDistanceMap() const {
         std::cout << steps_[0] << " " << steps_[1] << " " << steps_[2] << std::endl;
-        for (int i = 0; i < d_map_.size(); i++) {
-            std::cout << d_map_[i] << " ";
+        std::vector<double > values;
+        copyDistanceMap(values);
+        for (size_t i = 0; i < values.size(); i++) {
+            std::cout << values[i] << " ";
         }
         std::cout << std::endl;
     }
 
+    void ReachabilityMap::copyDistanceMap(std::vector<double > &values) const {
+        values.clear();
+        if (d_map_.empty()) {
+            return;
+        }
+        values.reserve(steps_[0] * steps_[1] * steps_[2]);
+        for (int ix = 0; ix < steps_[0]; ix++) {
+            for (int iy = 0; iy < steps_[1]; iy++) {
+                for (int iz = 0; iz < steps_[2]; iz++) {
+                    values.push_back(d_map_[composeIndex(ix, iy, iz)]);
+                }
+            }
+        }
+    }
+
+    void ReachabilityMap::copyVoxelBytes(const VoxelStorage<unsigned char > &storage, std::vector<unsigned char > &values) const {
+        values.clear();
+        if (storage.empty()) {
+            return;
+        }
+        values.reserve(steps_[0] * steps_[1] * steps_[2]);
+        for (int ix = 0; ix < steps_[0]; ix++) {
+            for (int iy = 0; iy < steps_[1]; iy++) {
+                for (int iz = 0; iz < steps_[2]; iz++) {
+                    values.push_back(storage.get(composeIndex(ix, iy, iz)));
+                }
+            }
+        }
+    }
+
+    // only the values other than background are written, so the sparse storage stays sparse
+    void ReachabilityMap::setVoxelBytes(const std::vector<unsigned char > &values, unsigned char background, VoxelStorage<unsigned char > &storage) {
+        if (values.empty()) {
+            return;
+        }
+        storage.reset(layout_steps_, 1, background);
+        int idx = 0;
+        for (int ix = 0; ix < steps_[0]; ix++) {
+            for (int iy = 0; iy < steps_[1]; iy++) {
+                for (int iz = 0; iz < steps_[2]; iz++) {
+                    if (values[idx] != background) {
+                        storage.set(composeIndex(ix, iy, iz), values[idx]);
+                    }
+                    idx++;
+                }
+            }
+        }
+    }
+
+    void ReachabilityMap::setDistanceMapLayout(DistanceMapLayout layout, int brick_size) {
+        int brick_bits = 0;
+        while ((1 << brick_bits) < brick_size) {
+            brick_bits++;
+        }
+        if (layout == LAYOUT_BRICKS && (brick_size < 1 || (1 << brick_bits) != brick_size)) {
+            std::cout << "ERROR: ReachabilityMap::setDistanceMapLayout: wrong brick size: " << brick_size << std::endl;
+            return;
+        }
+
+        std::vector<double > values;
+        copyDistanceMap(values);
+        std::vector<unsigned char > flags, parents;
+        copyVoxelBytes(flags_, flags);
+        copyVoxelBytes(parents_, parents);
+        layout_ = layout;
+        brick_bits_ = brick_bits;
+        updateLayout();
+        if (!values.empty()) {
+            d_map_.reset(layout_steps_, 1, 0.0);
+            int idx = 0;
+            for (int ix = 0; ix < steps_[0]; ix++) {
+                for (int iy = 0; iy < steps_[1]; iy++) {
+                    for (int iz = 0; iz < steps_[2]; iz++) {
+                        d_map_[composeIndex(ix, iy, iz)] = values[idx++];
+                    }
+                }
+            }
+        }
+        setVoxelBytes(flags, 0, flags_);
+        setVoxelBytes(parents, NO_PARENT, parents_);
+        if (!descent_.empty()) {
+            createGradientField(1);
+        }
+        resetCoefficientCache();
+    }
+
+    // map file layout: MapFileHeader, MapFileSection[sections_count_], then the section data
+    static const char MAP_FILE_MAGIC[8] = {'R', 'M', 'A', 'P', 'B', 'I', 'N', 0};
+    static const boost::uint32_t MAP_FILE_VERSION = 1;
+    static const boost::uint32_t MAP_FILE_BYTE_ORDER = 0x01020304;
+    static const int MAP_FILE_ALIGNMENT = 64;
+    static const size_t MAP_FILE_CHUNK_SIZE = 65536;
+
+    enum MapFileSectionId { SECTION_R_MAP = 1, SECTION_D_MAP = 2, SECTION_R_MAP_ROT = 3 };
+
+    struct MapFileHeader {
+        char magic_[8];
+        boost::uint32_t version_;
+        boost::uint32_t byte_order_;
+        boost::uint32_t sections_count_;
+        boost::int32_t dim_;
+        boost::int32_t max_value_;
+        boost::int32_t rot_resolution_;
+        boost::int32_t rot_words_;
+        boost::int32_t steps_[3];
+        double voxel_size_;
+        double ep_min_[3];
+        double ep_max_[3];
+        double origin_[3];
+    };
+
+    struct MapFileSection {
+        boost::uint32_t id_;
+        boost::uint32_t element_size_;
+        boost::uint64_t offset_;
+        boost::uint64_t count_;
+    };
+
+    static boost::uint64_t alignMapFileOffset(boost::uint64_t offset) {
+        return (offset + MAP_FILE_ALIGNMENT - 1) / MAP_FILE_ALIGNMENT * MAP_FILE_ALIGNMENT;
+    }
+
+    // the sparse storage is written in the dense layout, in chunks
+    template <typename Storage >
+    static void writeMapFileSection(std::ofstream &file, const Storage &storage) {
+        typedef typename Storage::value_type T;
+        if (storage.data() != NULL) {
+            file.write(reinterpret_cast<const char* >(storage.data()), storage.size() * sizeof(T));
+            return;
+        }
+        std::vector<T > buffer;
+        for (size_t begin = 0; begin < storage.size(); begin += MAP_FILE_CHUNK_SIZE) {
+            size_t end = std::min(storage.size(), begin + MAP_FILE_CHUNK_SIZE);
+            buffer.resize(end - begin);
+            for (size_t idx = begin; idx < end; idx++) {
+                buffer[idx - begin] = storage[idx];
+            }
+            file.write(reinterpret_cast<const char* >(&buffer[0]), buffer.size() * sizeof(T));
+        }
+    }
+
+    bool ReachabilityMap::save(const std::string &filename) const {
+        if (dim_ > 3) {
+            std::cout << "ERROR: ReachabilityMap::save: the file format does not support the dimension " << dim_ << std::endl;
+            return false;
+        }
+
+        std::vector<MapFileSection > sections;
+        if (!r_map_.empty()) {
+            MapFileSection sec = {SECTION_R_MAP, sizeof(int), 0, r_map_.size()};
+            sections.push_back(sec);
+        }
+        if (!d_map_.empty() && steps_.size() == 3) {
+            // without the padding of the layout
+            MapFileSection sec = {SECTION_D_MAP, sizeof(double), 0, static_cast<boost::uint64_t >(steps_[0]) * steps_[1] * steps_[2]};
+            sections.push_back(sec);
+        }
+        if (!r_map_rot_.empty()) {
+            MapFileSection sec = {SECTION_R_MAP_ROT, sizeof(boost::uint64_t), 0, r_map_rot_.size()};
+            sections.push_back(sec);
+        }
+
+        MapFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic_, MAP_FILE_MAGIC, sizeof(header.magic_));
+        header.version_ = MAP_FILE_VERSION;
+        header.byte_order_ = MAP_FILE_BYTE_ORDER;
+        header.sections_count_ = sections.size();
+        header.dim_ = dim_;
+        header.max_value_ = max_value_;
+        header.rot_resolution_ = rot_resolution_;
+        header.rot_words_ = rot_words_;
+        header.voxel_size_ = voxel_size_;
+        for (int dim_idx = 0; dim_idx < dim_ && dim_idx < static_cast<int >(steps_.size()); dim_idx++) {
+            header.steps_[dim_idx] = steps_[dim_idx];
+            header.ep_min_[dim_idx] = ep_min_(dim_idx);
+            header.ep_max_[dim_idx] = ep_max_(dim_idx);
+        }
+        for (int i = 0; i < 3; i++) {
+            header.origin_[i] = origin_[i];
+        }
+
+        boost::uint64_t offset = alignMapFileOffset(sizeof(MapFileHeader) + sections.size() * sizeof(MapFileSection));
+        for (size_t i = 0; i < sections.size(); i++) {
+            sections[i].offset_ = offset;
+            offset = alignMapFileOffset(offset + sections[i].count_ * sections[i].element_size_);
+        }
+
+        std::ofstream file(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            std::cout << "ERROR: ReachabilityMap::save: could not open file " << filename << std::endl;
+            return false;
+        }
+
+        file.write(reinterpret_cast<const char* >(&header), sizeof(header));
+        if (!sections.empty()) {
+            file.write(reinterpret_cast<const char* >(&sections[0]), sections.size() * sizeof(MapFileSection));
+        }
+        for (size_t i = 0; i < sections.size(); i++) {
+            std::vector<char > padding(sections[i].offset_ - file.tellp(), 0);
+            if (!padding.empty()) {
+                file.write(&padding[0], padding.size());
+            }
+            if (sections[i].id_ == SECTION_R_MAP) {
+                writeMapFileSection(file, r_map_);
+            }
+            else if (sections[i].id_ == SECTION_D_MAP && layout_bits_ == 0) {
+                writeMapFileSection(file, d_map_);
+            }
+            else if (sections[i].id_ == SECTION_D_MAP) {
+                // the file holds the row-major map
+                std::vector<double > values;
+                copyDistanceMap(values);
+                writeMapFileSection(file, values);
+            }
+            else if (sections[i].id_ == SECTION_R_MAP_ROT) {
+                writeMapFileSection(file, r_map_rot_);
+            }
+        }
+
+        if (!file.good()) {
+            std::cout << "ERROR: ReachabilityMap::save: could not write file " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool ReachabilityMap::load(const std::string &filename, bool memory_mapped) {
+        boost::shared_ptr<boost::interprocess::mapped_region > region;
+        std::vector<char > buffer;
+        const char *data = NULL;
+        boost::uint64_t size = 0;
+
+        if (memory_mapped) {
+            try {
+                boost::interprocess::file_mapping mapping(filename.c_str(), boost::interprocess::read_only);
+                region.reset( new boost::interprocess::mapped_region(mapping, boost::interprocess::read_only) );
+            }
+            catch (const boost::interprocess::interprocess_exception &e) {
+                std::cout << "ERROR: ReachabilityMap::load: could not map file " << filename << ": " << e.what() << std::endl;
+                return false;
+            }
+            data = static_cast<const char* >(region->get_address());
+            size = region->get_size();
+        }
+        else {
+            std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+            if (!file.is_open()) {
+                std::cout << "ERROR: ReachabilityMap::load: could not open file " << filename << std::endl;
+                return false;
+            }
+            buffer.assign(std::istreambuf_iterator<char >(file), std::istreambuf_iterator<char >());
+            data = buffer.empty() ? NULL : &buffer[0];
+            size = buffer.size();
+        }
+
+        if (size < sizeof(MapFileHeader)) {
+            std::cout << "ERROR: ReachabilityMap::load: file " << filename << " is too short" << std::endl;
+            return false;
+        }
+
+        MapFileHeader header;
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic_, MAP_FILE_MAGIC, sizeof(header.magic_)) != 0 || header.byte_order_ != MAP_FILE_BYTE_ORDER) {
+            std::cout << "ERROR: ReachabilityMap::load: wrong format of file " << filename << std::endl;
+            return false;
+        }
+        if (header.version_ != MAP_FILE_VERSION) {
+            std::cout << "ERROR: ReachabilityMap::load: unsupported version " << header.version_ << " of file " << filename << std::endl;
+            return false;
+        }
+        if (header.dim_ != dim_ || dim_ > 3) {
+            std::cout << "ERROR: ReachabilityMap::load: wrong dimension " << header.dim_ << " of the map in file " << filename << std::endl;
+            return false;
+        }
+        if (size < sizeof(MapFileHeader) + header.sections_count_ * sizeof(MapFileSection)) {
+            std::cout << "ERROR: ReachabilityMap::load: file " << filename << " is too short" << std::endl;
+            return false;
+        }
+
+        boost::uint64_t map_size = 1;
+        for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
+            if (header.steps_[dim_idx] <= 0) {
+                std::cout << "ERROR: ReachabilityMap::load: wrong size of the map in file " << filename << std::endl;
+                return false;
+            }
+            map_size *= header.steps_[dim_idx];
+        }
+
+        // all sections are checked before the map is changed
+        std::vector<MapFileSection > sections(header.sections_count_);
+        if (!sections.empty()) {
+            memcpy(&sections[0], data + sizeof(MapFileHeader), sections.size() * sizeof(MapFileSection));
+        }
+        for (size_t i = 0; i < sections.size(); i++) {
+            bool valid = sections[i].offset_ % MAP_FILE_ALIGNMENT == 0 && sections[i].offset_ + sections[i].count_ * sections[i].element_size_ <= size;
+            if (sections[i].id_ == SECTION_R_MAP) {
+                valid = valid && sections[i].element_size_ == sizeof(int) && sections[i].count_ == map_size;
+            }
+            else if (sections[i].id_ == SECTION_D_MAP) {
+                valid = valid && dim_ == 3 && sections[i].element_size_ == sizeof(double) && sections[i].count_ == map_size;
+            }
+            else if (sections[i].id_ == SECTION_R_MAP_ROT) {
+                valid = valid && header.rot_words_ > 0 && sections[i].element_size_ == sizeof(boost::uint64_t) && sections[i].count_ == map_size * header.rot_words_;
+            }
+            else {
+                valid = false;
+            }
+            if (!valid) {
+                std::cout << "ERROR: ReachabilityMap::load: wrong section " << sections[i].id_ << " in file " << filename << std::endl;
+                return false;
+            }
+        }
+
+        voxel_size_ = header.voxel_size_;
+        max_value_ = header.max_value_;
+        rot_resolution_ = header.rot_resolution_;
+        rot_words_ = header.rot_words_;
+        steps_.clear();
+        for (int dim_idx = 0; dim_idx < dim_; dim_idx++) {
+            steps_.push_back(header.steps_[dim_idx]);
+            ep_min_(dim_idx) = header.ep_min_[dim_idx];
+            ep_max_(dim_idx) = header.ep_max_[dim_idx];
+        }
+        updateLayout();
+        origin_ = KDL::Vector(header.origin_[0], header.origin_[1], header.origin_[2]);
+
+        r_map_.clear();
+        d_map_.clear();
+        r_map_rot_.clear();
+        p_map_.clear();
+        descent_.clear();
+        flags_.clear();
+        parents_.clear();
+        occupancy_.clear();
+        distance_params_ = DistanceMapParams();
+        for (size_t i = 0; i < sections.size(); i++) {
+            const char *section_data = data + sections[i].offset_;
+            if (sections[i].id_ == SECTION_R_MAP) {
+                r_map_.map(steps_, 1, reinterpret_cast<const int* >(section_data), 0);
+            }
+            else if (sections[i].id_ == SECTION_D_MAP) {
+                const double *values = reinterpret_cast<const double* >(section_data);
+                if (layout_bits_ == 0) {
+                    d_map_.map(steps_, 1, values, -1.0);
+                    continue;
+                }
+                d_map_.reset(layout_steps_, 1, -1.0);
+                for (size_t idx = 0; idx < map_size; idx++) {
+                    d_map_[composeIndex(idx / (steps_[1] * steps_[2]), (idx / steps_[2]) % steps_[1], idx % steps_[2])] = values[idx];
+                }
+            }
+            else {
+                r_map_rot_.map(steps_, rot_words_, reinterpret_cast<const boost::uint64_t* >(section_data), 0);
+            }
+        }
+
+        if (!memory_mapped) {
+            // the buffer is released at the end of this function
+            r_map_.detach();
+            d_map_.detach();
+            r_map_rot_.detach();
+        }
+        mapped_region_ = region;
+        resetCoefficientCache();
+        return true;
+    }
+
 /*****************************************************************************************************************************************************/
 
 